@@ -27,11 +27,29 @@
 #define CANBUS_PANEL_MPOS_2    0x113
 #define CANBUS_PANEL_MPOS_3    0x114
 #define CANBUS_PANEL_MPOS_4    0x115
+#define CANBUS_PANEL_MPOS_DELTA_1 0x116
+#define CANBUS_PANEL_MPOS_DELTA_2 0x117
+#define CANBUS_PANEL_VELOCITY_1   0x118
+#define CANBUS_PANEL_VELOCITY_2   0x119
+#define CANBUS_PANEL_STATE_3      0x11A     // medium rate - feed rate & line number
+#define CANBUS_PANEL_STATE_4      0x11B     // slow rate - tool, alarm & wcs
+#define CANBUS_PANEL_STATE_5      0x11C     // slow rate - firmware info
+#define CANBUS_PANEL_CAPS_REQUEST 0x11D     // ask the panel to send its capabilities
+#define CANBUS_PANEL_KEY_EVENT_ACK 0x11E    // sequence number of the last key event processed
+
+// Bulk channel, above the display frames of both panels (second panel offset 0x20) so it never
+// delays them or the panel inputs in arbitration
+#define CANBUS_PANEL_BULK_START   0x140     // id, transfer & total length of a new payload
+#define CANBUS_PANEL_BULK_DATA    0x141     // transfer, offset & up to 5 bytes of data
+
+#define CANBUS_PANEL_REALTIME  0x0F0     // realtime keys (Keypad_1), low id for bus arbitration priority
 
 #define CANBUS_PANEL_BLAAH     0x100
 #define CANBUS_PANEL_KEYPAD_1  0x101
-#define CANBUS_PANEL_KEYPAD_2  0x102
+#define CANBUS_PANEL_KEYPAD_2  0x102     // sent last in the panel cycle, bytes 4/5 are cycle sequence & frame mask, 6/7 panel ticks
 #define CANBUS_PANEL_ENCODER_1 0x103
 #define CANBUS_PANEL_ENCODER_2 0x104
+#define CANBUS_PANEL_CAPS      0x105     // panel capabilities, on request or at panel startup
+#define CANBUS_PANEL_KEY_EVENTS 0x106    // latched key edges, sequence number & key pairs
 
 
@@ -23,7 +23,7 @@
 
 #include "panel.h"
 
-#if PANEL_ENABLE == 1 || PANEL_ENABLE == 2
+#if PANEL_ENABLE >= 1 && PANEL_ENABLE <= 7
 
 #include <math.h>
 #include <string.h>
@@ -35,6 +35,8 @@
 #include "../grbl/report.h"
 #include "../grbl/nvs_buffer.h"
 #include "../grbl/protocol.h"
+#include "../grbl/stepper.h"
+#include "../grbl/planner.h"
 #include "../grbl/canbus.h"
 #else
 #include "grbl/hal.h"
@@ -42,34 +44,92 @@
 #include "grbl/report.h"
 #include "grbl/nvs_buffer.h"
 #include "grbl/protocol.h"
+#include "grbl/stepper.h"
+#include "grbl/planner.h"
 #include "grbl/canbus.h"
 #endif
 
-#if PANEL_ENABLE == 1 && !(MODBUS_ENABLE)
+#if PANEL_MODBUS && !(MODBUS_ENABLE)
 #error "This Control panel configuration requires the Modbus plugin to be enabled!"
 #endif
 
-#if PANEL_ENABLE == 2 && !defined(CAN_PORT)
+#if PANEL_CANBUS && !defined(CAN_PORT)
 #error "This Control panel configuration requires CAN driver support!"
 #endif
 
+#if PANEL_MODBUS && PANEL_MODBUS_MAX_WRITEREGS < 7
+#error "MODBUS_MAX_ADU_SIZE is too small for the control panel state registers!"
+#endif
+
 static on_report_options_ptr on_report_options;
 static on_execute_realtime_ptr on_execute_realtime;
+static on_wco_changed_ptr on_wco_changed;
+static on_tool_changed_ptr on_tool_changed;
+static on_reset_ptr on_reset;
+static on_state_change_ptr on_state_change;
+static on_override_changed_ptr on_override_changed;
+static on_gcode_message_ptr on_gcode_message;
 
 static void processKeypad(uint16_t[]);
+static void processRealtimeKeys(uint16_t);
 static void processEncoder(int);
-static void processDisplayData(panel_displaydata_t *);
+static void processEncoderJog(uint8_t);
+static void processEncoderOverride(uint8_t);
+static void processEncoderRapid(uint8_t);
+static uint8_t processDisplayData(panel_displaydata_t *, uint8_t);
+static void processStateData(panel_displaydata_t *);
+static void processOverrideData(panel_displaydata_t *);
+static uint8_t displayClassesDue(uint32_t);
+static uint_fast8_t packPositionWords(uint16_t *, panel_displaydata_t *, uint_fast8_t);
+static uint32_t panel_input_period(void);
+#if PANEL_MODBUS
+static void positionKeyframeAcknowledged(uint8_t);
+#endif
+#if PANEL_CANBUS || PANEL_UART
+static void positionKeyframeSent(void);
+#endif
+
+#if PANEL_MODBUS
+static const panel_transport_t modbus_transport;
+#endif
+#if PANEL_CANBUS
+static const panel_transport_t canbus_transport;
+#endif
+#if PANEL_UART
+static const panel_transport_t uart_transport;
+static panel_uart_t uart = { 0 };
+#endif
 
 // Globals
 static uint16_t grbl_state;
 static uint8_t mpg_axis = 0;
 static panel_jog_mode_t jog_mode = jog_mode_x10;
+static panel_jog_scale_t jog_scales[jog_mode_x100 + 1];     // indexed by jog mode, see setJogScales()
 
 static const char* axis[] = { "X", "Y", "Z", "A", "B", "C", "U", "V" }; // do we need a 'null' axis to disable mpg control?
 static const char* wcs_strings[] = { "G54", "G55", "G56", "G57", "G58", "G59", "G59.1", "G59.2", "G59.3" };
 
-static uint16_t keydata[N_KEYDATAS] = { 0 };
-static panel_encoder_data_t encoder_data[N_ENCODERS] = { 0 };
+static panel_stats_t panel_stats = { 0 };
+
+static panel_instance_t panels[PANEL_INSTANCES];
+static panel_instance_t *panel = &panels[0];    // panel being serviced
+static int8_t jog_owner = -1;                   // panel that may jog, -1 if none
+static uint32_t jog_owner_ms;                   // time of the jog owner's last jog input
+
+static uint16_t modbus_rx_timeout = PANEL_MODBUS_RX_TIMEOUT;     // from the controller setting, see getModbusRxTimeout()
+static uint16_t poll_interval = PANEL_DEFAULT_UPDATE_INTERVAL;  // current update interval, see pollUpdate()
+static uint16_t poll_base_interval = PANEL_DEFAULT_UPDATE_INTERVAL;  // as above, before the backoff is applied
+static uint8_t poll_backoff = 1;
+static uint32_t poll_activity_ms;               // time of the last encoder, key or machine movement
+
+static float wco[N_AXIS];                       // cached work coordinate offsets, including G92 & tool length offset
+static bool wco_valid = false;
+static uint8_t wco_coord_system;                // coordinate system the cached offsets were read for
+
+static panel_displaydata_t panel_displaydata;   // last display data sent, shared by the regular and event driven updates
+static bool display_event = false;              // state, alarm or override change to push to the panel
+static panel_spindle_cache_t spindle_cache[N_SYS_SPINDLE];
+static panel_bulk_t bulk = { 0 };               // bulk channel payload, sent in spare bus time
 
 static char sys_cmd_buffer[LINE_BUFFER_SIZE];
 
@@ -109,6 +169,24 @@ static const char encoder_mode[] = "Unused,"
 #endif
                                         ;
 
+#if PANEL_TRANSPORT_SELECT
+#if PANEL_UART
+static const char transports[] = "Modbus,CAN,UART";
+#else
+static const char transports[] = "Modbus,CAN";
+#endif
+#endif
+
+#if PANEL_UART
+static const char uart_bauds[] = "115200,230400,460800,921600";
+static const uint32_t uart_baud_rates[] = { 115200, 230400, 460800, 921600 };
+#endif
+
+static const char position_format[] = "Float,"
+                                      "Fixed 1um,"
+                                      "Fixed 0.1um,"
+                                      "Delta 1um";
+
 static const setting_detail_t panel_setting_detail[] = {
     { Setting_Panel_ModbusAddress, Group_Panel, "Control panel ModBus address", NULL, Format_Int8, "##0", NULL, "255", Setting_NonCore, &panel_settings.modbus_address, NULL, NULL },
 
@@ -125,7 +203,38 @@ static const setting_detail_t panel_setting_detail[] = {
     { Setting_Panel_JogDistance_x100, Group_Panel, "Control panel x100 jog distance", NULL, Format_Decimal, "###0.000", "0.001", "10", Setting_NonCore, &panel_settings.jog_distance_x100, NULL , NULL },
     { Setting_Panel_JogDistance_Keypad, Group_Panel, "Control panel keypad jog distance", NULL, Format_Decimal, "###0.000", "0.001", "10", Setting_NonCore, &panel_settings.jog_distance_keypad, NULL , NULL },
 
-    { Setting_Panel_JogAccelRamp, Group_Panel, "Control panel keypad jog acceleration ramp", NULL, Format_Int8, "##0", "10", "100", Setting_NonCore, &panel_settings.jog_accel_ramp, NULL , NULL },
+    { Setting_Panel_JogAccelRamp, Group_Panel, "Control panel keypad jog lookahead margin (ms)", NULL, Format_Int8, "##0", "0", "250", Setting_NonCore, &panel_settings.jog_keypad_margin, NULL , NULL },
+
+    { Setting_Panel_JogDeadman, Group_Panel, "Control panel keypad jog dead-man timeout", NULL, Format_Int8, "##0", "0", "50", Setting_NonCore, &panel_settings.jog_deadman, NULL , NULL },
+
+#if PANEL_MODBUS
+    { Setting_Panel_RealtimeInterval, Group_Panel, "Control panel realtime key poll interval (ms)", NULL, Format_Int8, "##0", "0", "250", Setting_NonCore, &panel_settings.realtime_interval, NULL , NULL },
+#endif
+
+    { Setting_Panel_PositionFormat, Group_Panel, "Control panel position format", NULL, Format_RadioButtons, position_format, NULL, NULL, Setting_NonCore, &panel_settings.position_format, NULL, NULL },
+
+    { Setting_Panel_Velocity, Group_Panel, "Control panel send velocity", NULL, Format_Bool, NULL, NULL, NULL, Setting_NonCore, &panel_settings.velocity, NULL, NULL },
+
+    { Setting_Panel_EventInterval, Group_Panel, "Control panel event update interval (ms)", NULL, Format_Int8, "##0", "0", "250", Setting_NonCore, &panel_settings.event_interval, NULL , NULL },
+
+    { Setting_Panel_MediumInterval, Group_Panel, "Control panel medium rate update interval (ms)", NULL, Format_Int16, "###0", "50", "5000", Setting_NonCore, &panel_settings.medium_interval, NULL , NULL },
+    { Setting_Panel_SlowInterval, Group_Panel, "Control panel slow rate update interval (ms)", NULL, Format_Int16, "####0", "100", "10000", Setting_NonCore, &panel_settings.slow_interval, NULL , NULL },
+
+    { Setting_Panel_ActiveInterval, Group_Panel, "Control panel active update interval (ms)", NULL, Format_Int16, "###0", "0", "1000", Setting_NonCore, &panel_settings.active_interval, NULL , NULL },
+    { Setting_Panel_IdleInterval, Group_Panel, "Control panel idle update interval (ms)", NULL, Format_Int16, "###0", "25", "5000", Setting_NonCore, &panel_settings.idle_interval, NULL , NULL },
+    { Setting_Panel_IdleTimeout, Group_Panel, "Control panel idle timeout (s)", NULL, Format_Int8, "##0", "0", "255", Setting_NonCore, &panel_settings.idle_timeout, NULL , NULL },
+#if PANEL_MODBUS
+    { Setting_Panel_BusDuty, Group_Panel, "Control panel back-to-back polling duty cycle (%)", NULL, Format_Int8, "##0", "0", "100", Setting_NonCore, &panel_settings.bus_duty, NULL , NULL },
+#endif
+#if PANEL_TRANSPORT_SELECT
+    { Setting_Panel_Transport, Group_Panel, "Control panel transport", NULL, Format_RadioButtons, transports, NULL, NULL, Setting_NonCore, &panel_settings.transport[0], NULL, NULL },
+#if PANEL_INSTANCES > 1
+    { Setting_Panel2_Transport, Group_Panel, "Control panel #2 transport", NULL, Format_RadioButtons, transports, NULL, NULL, Setting_NonCore, &panel_settings.transport[1], NULL, NULL },
+#endif
+#endif
+#if PANEL_UART
+    { Setting_Panel_UartBaud, Group_Panel, "Control panel UART baud rate", NULL, Format_RadioButtons, uart_bauds, NULL, NULL, Setting_NonCore, &panel_settings.uart_baud, NULL, NULL },
+#endif
 
     { Setting_Panel_Encoder0_Mode, Group_Panel, "Control panel encoder #0 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.encoder_mode[0], NULL, NULL },
     { Setting_Panel_Encoder0_Cpd, Group_Panel, "Control panel encoder #0 counts per detent", NULL, Format_Int8,"#0", "1", "4", Setting_NonCore, &panel_settings.encoder_cpd[0], NULL, NULL },
@@ -138,16 +247,87 @@ static const setting_detail_t panel_setting_detail[] = {
 
     { Setting_Panel_Encoder3_Mode, Group_Panel, "Control panel encoder #3 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.encoder_mode[3], NULL, NULL },
     { Setting_Panel_Encoder3_Cpd, Group_Panel, "Control panel encoder #3 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.encoder_cpd[3], NULL, NULL },
+#if PANEL_INSTANCES > 1
+    { Setting_Panel2_ModbusAddress, Group_Panel, "Control panel #2 ModBus address", NULL, Format_Int8, "##0", NULL, "255", Setting_NonCore, &panel_settings.panel2_modbus_address, NULL, NULL },
+    { Setting_Panel_JogPriority, Group_Panel, "Control panel jog priority", NULL, Format_Int8, "##0", NULL, "255", Setting_NonCore, &panel_settings.jog_priority[0], NULL, NULL },
+    { Setting_Panel2_JogPriority, Group_Panel, "Control panel #2 jog priority", NULL, Format_Int8, "##0", NULL, "255", Setting_NonCore, &panel_settings.jog_priority[1], NULL, NULL },
+    { Setting_Panel2_Encoder0_Mode, Group_Panel, "Control panel #2 encoder #0 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.panel2_encoder_mode[0], NULL, NULL },
+    { Setting_Panel2_Encoder0_Cpd, Group_Panel, "Control panel #2 encoder #0 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.panel2_encoder_cpd[0], NULL, NULL },
+    { Setting_Panel2_Encoder1_Mode, Group_Panel, "Control panel #2 encoder #1 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.panel2_encoder_mode[1], NULL, NULL },
+    { Setting_Panel2_Encoder1_Cpd, Group_Panel, "Control panel #2 encoder #1 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.panel2_encoder_cpd[1], NULL, NULL },
+    { Setting_Panel2_Encoder2_Mode, Group_Panel, "Control panel #2 encoder #2 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.panel2_encoder_mode[2], NULL, NULL },
+    { Setting_Panel2_Encoder2_Cpd, Group_Panel, "Control panel #2 encoder #2 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.panel2_encoder_cpd[2], NULL, NULL },
+    { Setting_Panel2_Encoder3_Mode, Group_Panel, "Control panel #2 encoder #3 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.panel2_encoder_mode[3], NULL, NULL },
+    { Setting_Panel2_Encoder3_Cpd, Group_Panel, "Control panel #2 encoder #3 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.panel2_encoder_cpd[3], NULL, NULL },
+#endif
+#if N_ENCODERS > 4
+    { Setting_Panel_Encoder4_Mode, Group_Panel, "Control panel encoder #4 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.encoder_mode[4], NULL, NULL },
+    { Setting_Panel_Encoder4_Cpd, Group_Panel, "Control panel encoder #4 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.encoder_cpd[4], NULL, NULL },
+#endif
+#if N_ENCODERS > 5
+    { Setting_Panel_Encoder5_Mode, Group_Panel, "Control panel encoder #5 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.encoder_mode[5], NULL, NULL },
+    { Setting_Panel_Encoder5_Cpd, Group_Panel, "Control panel encoder #5 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.encoder_cpd[5], NULL, NULL },
+#endif
+#if N_ENCODERS > 6
+    { Setting_Panel_Encoder6_Mode, Group_Panel, "Control panel encoder #6 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.encoder_mode[6], NULL, NULL },
+    { Setting_Panel_Encoder6_Cpd, Group_Panel, "Control panel encoder #6 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.encoder_cpd[6], NULL, NULL },
+#endif
+#if N_ENCODERS > 7
+    { Setting_Panel_Encoder7_Mode, Group_Panel, "Control panel encoder #7 mode", NULL, Format_RadioButtons, encoder_mode, NULL, NULL, Setting_NonCore, &panel_settings.encoder_mode[7], NULL, NULL },
+    { Setting_Panel_Encoder7_Cpd, Group_Panel, "Control panel encoder #7 counts per detent", NULL, Format_Int8, "#0", "1", "4", Setting_NonCore, &panel_settings.encoder_cpd[7], NULL, NULL },
+#endif
 };
 
 #ifndef NO_SETTINGS_DESCRIPTIONS
 static const setting_descr_t panel_settings_descr[] = {
-        { Setting_Panel_JogDistance_Keypad, "The distance requested when keypad jogging. "
-                                            "If a key is held down, a new jog request is repeated at each panel update interval." },
-        { Setting_Panel_JogSpeed_Keypad, "The speed requested when keypad jogging. "
-                                         "If a key is held down, a new jog request is repeated at each panel update interval." },
-        { Setting_Panel_JogAccelRamp, "If a key is held down, keypad jogging will accelerate to the requested speed over this number of panel updates.\\n"
-                                      "Note: for ModBus connections, the number of updates will be doubled, as inputs and outputs are interleaved." },
+        { Setting_Panel_JogDistance_Keypad, "The maximum distance requested by a single keypad jog command. "
+                                            "If a key is held down, a new jog request is repeated each time the panel inputs are read." },
+        { Setting_Panel_JogSpeed_Keypad, "The speed requested when keypad jogging, limited to the axis maximum rate. "
+                                         "Keypad jogging accelerates to this speed at the configured axis acceleration." },
+        { Setting_Panel_JogAccelRamp, "Each keypad jog request covers the distance the axis can travel until the next expected panel input, plus this margin.\\n"
+                                      "Larger values tolerate more bus jitter, at the cost of a longer overrun after the key is released." },
+        { Setting_Panel_JogDeadman, "Keypad jogging is cancelled if no keypad data is received from the panel within this number of expected input periods.\\n"
+                                    "Protects against the machine continuing to move if the panel connection is lost mid-jog. Set to 0 to disable." },
+#if PANEL_MODBUS
+        { Setting_Panel_RealtimeInterval, "Stop, feed hold, cycle start and reset are additionally polled at this interval, with a short read of the Keypad_1 register only.\\n"
+                                          "Each poll costs around 15 bytes of bus time. Set to 0 to disable, realtime keys are then only read with the other panel inputs." },
+#endif
+        { Setting_Panel_PositionFormat, "Encoding used to send axis positions to the panel.\\n"
+                                        "Float sends up to 3 axes for Modbus, the fixed point and delta formats send all axes. "
+                                        "Delta sends 16 bit increments from the last acknowledged absolute keyframe." },
+        { Setting_Panel_Velocity, "Send the position sample time and axis velocities along with the positions, so the panel can interpolate the displayed position between updates.\\n"
+                                  "For Modbus, these are only sent if they fit in the same write as the positions." },
+        { Setting_Panel_EventInterval, "State changes, alarms and override changes are sent to the panel immediately, without waiting for the next display update. "
+                                       "This sets the minimum time between these extra updates, so a burst of events can't flood the bus. Set to 0 to disable." },
+        { Setting_Panel_MediumInterval, "Update period for feed rate and line number, sent only if changed. "
+                                        "Overrides and spindle data are sent with every update, spindle data is refreshed separately, paced by the Modbus RX timeout." },
+        { Setting_Panel_SlowInterval, "Update period for WCS, tool, alarm and firmware data, sent only if changed. These are also sent with the next update after they change." },
+        { Setting_Panel_ActiveInterval, "The panel is updated at this faster interval while encoders are turning, keys are pressed or jog keys held, or the machine is moving. "
+                                        "Set to 0 to always use the update interval." },
+        { Setting_Panel_IdleInterval, "The panel is updated at this slower interval once it and the machine have been quiet for the idle timeout." },
+        { Setting_Panel_IdleTimeout, "Quiet time before the panel drops to the idle update interval. Set to 0 to disable.\\n"
+                                     "For Modbus the interval is also lengthened, up to 4 times, while the bus is saturated." },
+#if PANEL_MODBUS
+        { Setting_Panel_BusDuty, "Send the next panel request as soon as the previous reply has arrived and the Modbus inter-frame gap has passed, rather than waiting for the next update interval. "
+                                 "Limits the bus time used, by the panel and other Modbus devices, to this share. Set to 0 to disable." },
+#endif
+#if PANEL_TRANSPORT_SELECT
+        { Setting_Panel_Transport, "Transport used to communicate with the panel. With a second panel, e.g. a CAN pendant alongside a Modbus display, each can use either. "
+                                   "A transport not built in falls back to the first one that is." },
+#if PANEL_INSTANCES > 1
+        { Setting_Panel2_Transport, "Transport used to communicate with the second panel, as for the first. "
+                                    "A second Modbus panel is only polled if its address is set." },
+#endif
+#endif
+#if PANEL_UART
+        { Setting_Panel_UartBaud, "Baud rate of the serial stream used by a UART panel." },
+#endif
+#if PANEL_INSTANCES > 1
+        { Setting_Panel2_ModbusAddress, "ModBus address of a second panel, e.g. a handheld pendant. 0 to disable. Panels are polled in turn." },
+        { Setting_Panel_JogPriority, "A panel with a higher jog priority takes over jogging from another, cancelling its jog. "
+                                     "With equal priority the panel that started jogging keeps control until it stops." },
+        { Setting_Panel2_JogPriority, "See the control panel jog priority." },
+#endif
         { Setting_Panel_Encoder0_Cpd, "Encoder counts per detent. Typically this would be 1, 2, or 4, and would be configured to match the physical detents on the encoder." },
         { Setting_Panel_Encoder1_Cpd, "Encoder counts per detent. Typically this would be 1, 2, or 4, and would be configured to match the physical detents on the encoder." },
         { Setting_Panel_Encoder2_Cpd, "Encoder counts per detent. Typically this would be 1, 2, or 4, and would be configured to match the physical detents on the encoder." },
@@ -174,7 +354,27 @@ static void panel_settings_restore (void)
     panel_settings.jog_distance_x100   = PANEL_DEFAULT_JOG_DISTANCE_X100;
     panel_settings.jog_distance_keypad = PANEL_DEFAULT_JOG_DISTANCE_KEYPAD;
 
-    panel_settings.jog_accel_ramp      = PANEL_DEFAULT_JOG_KEYPAD_RAMP;
+    panel_settings.jog_keypad_margin   = PANEL_DEFAULT_JOG_KEYPAD_MARGIN;
+    panel_settings.jog_deadman         = PANEL_DEFAULT_JOG_DEADMAN;
+    panel_settings.realtime_interval   = PANEL_DEFAULT_REALTIME_INTERVAL;
+    panel_settings.position_format     = PANEL_DEFAULT_POSITION_FORMAT;
+    panel_settings.velocity            = false;
+    panel_settings.event_interval      = PANEL_DEFAULT_EVENT_INTERVAL;
+    panel_settings.medium_interval     = PANEL_DEFAULT_MEDIUM_INTERVAL;
+    panel_settings.slow_interval       = PANEL_DEFAULT_SLOW_INTERVAL;
+    panel_settings.active_interval     = PANEL_DEFAULT_ACTIVE_INTERVAL;
+    panel_settings.idle_interval       = PANEL_DEFAULT_IDLE_INTERVAL;
+    panel_settings.idle_timeout        = PANEL_DEFAULT_IDLE_TIMEOUT;
+    panel_settings.bus_duty            = PANEL_DEFAULT_BUS_DUTY;
+#if PANEL_TRANSPORT_SELECT
+    // the first panel on the first transport built in, the second on the next
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++)
+        panel_settings.transport[idx] = idx == 0 ? PANEL_TRANSPORT_FIRST : (PANEL_MODBUS && PANEL_CANBUS ? PanelTransport_CANbus : PanelTransport_UART);
+#endif
+#if PANEL_UART
+    panel_settings.uart_baud           = PANEL_DEFAULT_UART_BAUD;
+#endif
+    panel_settings.version             = PANEL_SETTINGS_VERSION;
 
     panel_settings.encoder_mode[0] = jog_mpg;
     panel_settings.encoder_cpd[0]  = 4;
@@ -184,6 +384,20 @@ static void panel_settings_restore (void)
     panel_settings.encoder_cpd[2]  = 4;
     panel_settings.encoder_mode[3] = feed_override;
     panel_settings.encoder_cpd[3]  = 4;
+    for (uint_fast8_t idx = 4; idx < N_ENCODERS; idx++) {
+        panel_settings.encoder_mode[idx] = unused;
+        panel_settings.encoder_cpd[idx]  = 4;
+    }
+
+#if PANEL_INSTANCES > 1
+    panel_settings.panel2_modbus_address = 0;
+    for (uint_fast8_t idx = 0; idx < PANEL2_ENCODERS; idx++) {
+        panel_settings.panel2_encoder_mode[idx] = idx == 0 ? jog_mpg : unused;
+        panel_settings.panel2_encoder_cpd[idx]  = 4;
+    }
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++)
+        panel_settings.jog_priority[idx] = 0;
+#endif
 
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&panel_settings, sizeof(panel_settings_t), true);
 }
@@ -194,7 +408,8 @@ static void panel_settings_load (void)
 {
     //printf("panel_settings_load()\n");
 
-    if(hal.nvs.memcpy_from_nvs((uint8_t *)&panel_settings, nvs_address, sizeof(panel_settings_t), true) != NVS_TransferResult_OK) {
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&panel_settings, nvs_address, sizeof(panel_settings_t), true) != NVS_TransferResult_OK ||
+        panel_settings.version != PANEL_SETTINGS_VERSION) {
         panel_settings_restore();
     }
 }
@@ -207,15 +422,166 @@ static void panel_settings_save (void)
     hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&panel_settings, sizeof(panel_settings_t), true);
 }
 
+static panel_transport_id_t panelTransport (uint_fast8_t idx)
+{
+#if PANEL_TRANSPORT_SELECT
+    if (panel_settings.transport[idx] <= PanelTransport_UART && (PANEL_ENABLE & (1 << panel_settings.transport[idx])))
+        return (panel_transport_id_t)panel_settings.transport[idx];
+#endif
+    return PANEL_TRANSPORT_FIRST;
+}
+
+// Bind each panel to its transport, a panel moved to another transport is probed again
+static void setTransports (void)
+{
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++) {
+        const panel_transport_t *transport = NULL;
+
+        switch (panelTransport(idx)) {
+#if PANEL_MODBUS
+            case PanelTransport_Modbus:
+                transport = &modbus_transport;
+                break;
+#endif
+#if PANEL_CANBUS
+            case PanelTransport_CANbus:
+                transport = &canbus_transport;
+                break;
+#endif
+#if PANEL_UART
+            case PanelTransport_UART:
+                transport = &uart_transport;
+                break;
+#endif
+            default:
+                break;
+        }
+
+        if (panels[idx].transport != transport) {
+            if (panels[idx].transport) {
+                memset(&panels[idx].caps, 0, sizeof(panel_caps_t));
+                memset(&panels[idx].key_events, 0, sizeof(panel_key_events_t));
+                memset(&panels[idx].clock, 0, sizeof(panel_clock_t));
+                panels[idx].input_chunks.start = panels[idx].input_chunks.next = 0;
+                panels[idx].input_chunks.n_registers = PANEL_MODBUS_READREG_COUNT;
+            }
+            panels[idx].transport = transport;
+        }
+    }
+}
+
+// Resolve each encoder's mode to its handler, jog axis or override commands, and the counts per detent scaling
+static void setEncoderHandlers (void)
+{
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++) {
+        for (uint_fast8_t i = 0; i < N_ENCODERS; i++) {
+            panel_encoder_data_t *encoder = &panels[idx].encoder_data[i];
+
+            encoder->handler = NULL;
+            encoder->axis = PANEL_ENCODER_MPG_AXIS;
+
+            switch (encoder->mode) {
+                case jog_mpg:
+                    encoder->handler = processEncoderJog;
+                    break;
+
+                case jog_x: case jog_y: case jog_z: case jog_a:
+                case jog_b: case jog_c: case jog_u: case jog_v:
+                    encoder->handler = processEncoderJog;
+                    encoder->axis = encoder->mode - jog_x;
+                    break;
+
+                case spindle_override:
+                    encoder->handler = processEncoderOverride;
+                    encoder->cmd_minus = CMD_OVERRIDE_SPINDLE_FINE_MINUS;
+                    encoder->cmd_plus  = CMD_OVERRIDE_SPINDLE_FINE_PLUS;
+                    break;
+
+                case feed_override:
+                    encoder->handler = processEncoderOverride;
+                    encoder->cmd_minus = CMD_OVERRIDE_FEED_FINE_MINUS;
+                    encoder->cmd_plus  = CMD_OVERRIDE_FEED_FINE_PLUS;
+                    break;
+
+                case rapid_override:
+                    encoder->handler = processEncoderRapid;
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (encoder->cpd == 0)
+                encoder->cpd = 1;
+
+            if (!(encoder->cpd & (encoder->cpd - 1))) {
+                encoder->cpd_shift = 0;
+                while ((1 << encoder->cpd_shift) < encoder->cpd)
+                    encoder->cpd_shift++;
+            } else {
+                encoder->cpd_shift = PANEL_ENCODER_CPD_RECIP;
+                encoder->cpd_recip = 0xFFFFFFFFUL / encoder->cpd + 1;
+            }
+        }
+    }
+}
+
+// Encoder jog distance & feed for the stepped jog modes, the feed pre-formatted
+static void setJogScales (void)
+{
+    static const uint8_t modes[] = { jog_mode_x1, jog_mode_x10, jog_mode_x100 };
+    const float distances[] = { panel_settings.jog_distance_x1, panel_settings.jog_distance_x10, panel_settings.jog_distance_x100 };
+    const uint16_t speeds[] = { panel_settings.jog_speed_x1, panel_settings.jog_speed_x10, panel_settings.jog_speed_x100 };
+
+    memset(jog_scales, 0, sizeof(jog_scales));
+
+    for (uint_fast8_t idx = 0; idx < sizeof(modes); idx++) {
+        jog_scales[modes[idx]].distance = distances[idx];
+        strcpy(jog_scales[modes[idx]].feed, "F");
+        strcat(jog_scales[modes[idx]].feed, ftoa(speeds[idx], 0));
+    }
+}
+
+// Transaction and spindle refresh timing follow the Modbus RX timeout setting of the controller
+static void getModbusRxTimeout (void)
+{
+    const setting_detail_t *setting = setting_get_details(Setting_ModbusRxTimeout, NULL);
+
+    modbus_rx_timeout = setting ? max(setting_get_int_value(setting, 0), 1) : PANEL_MODBUS_RX_TIMEOUT;
+}
+
 // Plugin settings have been changed.
 void on_settings_changed (settings_t *settings, settings_changed_flags_t changed)
 {
     //printf("on_settings_changed()\n");
 
     for (uint8_t i=0; i < N_ENCODERS; i++) {
-        encoder_data[i].mode = panel_settings.encoder_mode[i];
-        encoder_data[i].cpd = panel_settings.encoder_cpd[i];
+        panels[0].encoder_data[i].mode = panel_settings.encoder_mode[i];
+        panels[0].encoder_data[i].cpd = panel_settings.encoder_cpd[i];
+    }
+
+#if PANEL_INSTANCES > 1
+    for (uint8_t i=0; i < N_ENCODERS; i++) {
+        panels[1].encoder_data[i].mode = i < PANEL2_ENCODERS ? panel_settings.panel2_encoder_mode[i] : unused;
+        panels[1].encoder_data[i].cpd = i < PANEL2_ENCODERS ? panel_settings.panel2_encoder_cpd[i] : 4;
     }
+#endif
+
+    wco_valid = false;
+
+    getModbusRxTimeout();
+    setEncoderHandlers();
+    setJogScales();
+
+    setTransports();
+
+#if PANEL_UART
+    if (uart.open && uart.stream.set_baud_rate)
+        uart.stream.set_baud_rate(uart_baud_rates[min(panel_settings.uart_baud, sizeof(uart_baud_rates) / sizeof(uint32_t) - 1)]);
+#endif
+
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++)
+        panels[idx].position_delta.keyframe_due = true;
 }
 
 static setting_details_t setting_details = {
@@ -237,389 +603,2178 @@ static setting_details_t setting_details = {
  * End of settings specific code
  */
 
-#if PANEL_ENABLE == 1
-static void rx_modbus_packet (modbus_message_t *msg);
-static void rx_modbus_exception (uint8_t code, void *context);
+// Panels currently configured, the first is always active. A second Modbus panel is enabled by its address.
+static uint_fast8_t panelsActive (void)
+{
+#if PANEL_INSTANCES > 1
+    return panelTransport(1) == PanelTransport_Modbus && !panel_settings.panel2_modbus_address ? 1 : 2;
+#else
+    return 1;
+#endif
+}
 
-static const modbus_callbacks_t modbus_callbacks = {
-    .on_rx_packet = rx_modbus_packet,
-    .on_rx_exception = rx_modbus_exception
-};
+// The nth active panel on a transport, or a polled transport if NULL. Returns NULL if there is none.
+static panel_instance_t *transportPanel (const panel_transport_t *transport, uint_fast8_t n)
+{
+    for (uint_fast8_t idx = 0; idx < panelsActive(); idx++) {
+        if (transport ? panels[idx].transport == transport : panels[idx].transport->polled) {
+            if (n-- == 0)
+                return &panels[idx];
+        }
+    }
 
-static void ReadModbusInputRegisters(bool block)
+    return NULL;
+}
+
+static uint_fast8_t transportPanels (const panel_transport_t *transport)
 {
-    modbus_message_t read_cmd = {
-        .context = (void *)Panel_ReadInputRegisters,
-        .crc_check = true,
-        .adu[0] = panel_settings.modbus_address,
-        .adu[1] = ModBus_ReadInputRegisters,
-        .adu[2] = 0x00,                                 // Start address   - high byte
-        .adu[3] = PANEL_MODBUS_START_REG,               // Start address   - low byte - 100 (0x64)
-        .adu[4] = 0x00,                                 // No of registers - high byte
-        .adu[5] = PANEL_MODBUS_READREG_COUNT,           // No of registers - low byte
-        .tx_length = 8,                                 // number of registers, plus 2 checksum bytes
-        .rx_length = (2*PANEL_MODBUS_READREG_COUNT) + 5 // number of data registers requested,
-                                                        // plus 3 header bytes (address, function, length),
-                                                        // plus 2 checksum bytes
-         // note: rx_length & tx_length must be less than or equal to MODBUS_MAX_ADU_SIZE
-    };
+    uint_fast8_t n = 0;
 
-    modbus_send(&read_cmd, &modbus_callbacks, block);
+    while (transportPanel(transport, n))
+        n++;
+
+    return n;
 }
 
-static void WriteModbusHoldingRegisters(bool block)
+// Ask the panel for its capabilities, a panel that doesn't answer is treated as a legacy panel.
+// Returns true if a request was sent.
+static bool panelProbe (void)
 {
-    static panel_displaydata_t displaydata;
+    if (panel->caps.probed)
+        return false;
 
-    processDisplayData(&displaydata);
+    if (panel->caps.attempts >= PANEL_CAPS_ATTEMPTS) {
+        panel->caps.probed = true;      // no answer, assume a legacy panel
+        return false;
+    }
 
-    modbus_message_t write_cmd = {
-        .context = (void *)Panel_WriteHoldingRegisters,
-        .crc_check = true,
-        .adu[0] = panel_settings.modbus_address,
-        .adu[1] = ModBus_WriteRegisters,
-        .adu[2] = 0x00,                                         // Start address - high byte
-        .adu[3] = PANEL_MODBUS_START_REG,                       // Start address - low byte - 100 (0x64)
-        .adu[4] = 0x00,                                         // No of 16bit registers - high byte
-        .adu[5] = PANEL_MODBUS_WRITEREG_COUNT,                  // No of 16bit registers - low byte
-        .adu[6] = PANEL_MODBUS_WRITEREG_COUNT*2,                // Number of bytes
+    panel->caps.attempts++;
+    panel->transport->capabilities();
 
-        .adu[7] = (displaydata.grbl_state >> 8) & 0xFF,         // Register 100 - high byte
-        .adu[8] = displaydata.grbl_state & 0xFF,                // Register 100 - low byte
+    return true;
+}
 
-        .adu[11] = (displaydata.spindle_speed >> 8) & 0xFF,     // Register 102 - high byte
-        .adu[12] = displaydata.spindle_speed & 0xFF,            // Register 102 - low byte
+// Display axes, position encodings & velocities limited to what the panel reports it supports
+static uint_fast8_t panelAxes (void)
+{
+    return panel->caps.valid ? min(panel->caps.axes, N_AXIS) : N_AXIS;
+}
 
-#if VFD_ENABLE
-        .adu[13] = (displaydata.spindle_load >> 8) & 0xFF,      // Register 103 - high byte
-        .adu[14] = displaydata.spindle_load & 0xFF,             // Register 103 - low byte
-#endif
+static panel_position_format_t panelPositionFormat (void)
+{
+    return !panel->caps.valid || (panel->caps.encodings & (1 << panel_settings.position_format))
+            ? (panel_position_format_t)panel_settings.position_format
+            : PositionFormat_Float;
+}
+
+static bool panelVelocity (void)
+{
+    return panel_settings.velocity && (!panel->caps.valid || (panel->caps.encodings & PANEL_POSITION_FORMAT_VELOCITY));
+}
+
+// Decode the capability block, same layout for the Modbus registers and the CAN frame
+static void setCapabilities (const uint8_t *data)
+{
+    panel->caps.protocol  = data[0];
+    panel->caps.fw_major  = data[1];
+    panel->caps.fw_minor  = data[2];
+    panel->caps.fw_patch  = data[3];
+    panel->caps.keys      = min(data[4], N_KEYDATAS);
+    panel->caps.encoders  = min(data[5], N_ENCODERS);
+    panel->caps.axes      = data[6];
+    panel->caps.encodings = data[7] | (1 << PositionFormat_Float);
+    panel->caps.valid = panel->caps.probed = true;
+
+    // a (re)started panel, send it everything
+    panel->position_delta.keyframe_due = true;
+    panel->rate_sent.medium_valid = panel->rate_sent.slow_valid = false;
+}
 
-        .adu[15] = displaydata.wcs,                             // Register 104 - high byte
-        .adu[16] = displaydata.spindle_override,                // Register 104 - low byte
+// Apply latched key edges on top of the last keypad state, so that taps shorter than the input period are
+// not lost. Events are sequence number & key byte pairs, oldest first, events already processed are skipped.
+static void processKeyEvents (const uint8_t *events, uint_fast8_t n_events)
+{
+    panel_key_events_t *key_events = &panel->key_events;
+    uint16_t keydata[N_KEYDATAS];
 
-        .adu[17] = displaydata.rapid_override,                  // Register 105 - high byte
-        .adu[18] = displaydata.feed_override,                   // Register 105 - low byte
+    if (n_events == 0)
+        return;
 
-        .adu[19] = displaydata.mpg_mode,                        // Register 106 - high byte
-        .adu[20] = displaydata.jog_mode,                        // Register 106 - low byte
+    // events latched before the controller started are acknowledged without acting on them
+    if (!key_events->seq_valid) {
+        key_events->seq = events[(n_events - 1) * 2];
+        key_events->seq_valid = key_events->ack_due = true;
+        return;
+    }
 
-        .adu[21] = displaydata.position[0].bytes[1],            // Register 107 - x position
-        .adu[22] = displaydata.position[0].bytes[0],            // Register 107 - x position
-        .adu[23] = displaydata.position[0].bytes[3],            // Register 108 - x position
-        .adu[24] = displaydata.position[0].bytes[2],            // Register 108 - x position
+    memcpy(keydata, panel->last_keydata, sizeof(keydata));
 
-        .adu[25] = displaydata.position[1].bytes[1],            // Register 109 - y position
-        .adu[26] = displaydata.position[1].bytes[0],            // Register 109 - y position
-        .adu[27] = displaydata.position[1].bytes[3],            // Register 110 - y position
-        .adu[28] = displaydata.position[1].bytes[2],            // Register 110 - y position
+    for (uint_fast8_t idx = 0; idx < n_events; idx++) {
+        uint8_t seq = events[idx * 2], key = events[idx * 2 + 1] & ~PANEL_KEY_EVENT_PRESSED;
+        uint8_t ahead = seq - key_events->seq;
 
-        .adu[29] = displaydata.position[2].bytes[1],            // Register 111 - z position
-        .adu[30] = displaydata.position[2].bytes[0],            // Register 111 - z position
-        .adu[31] = displaydata.position[2].bytes[3],            // Register 112 - z position
-        .adu[32] = displaydata.position[2].bytes[2],            // Register 112 - z position
+        if (ahead == 0 || ahead > 127)
+            continue;                   // already processed
 
-        .tx_length = (2*PANEL_MODBUS_WRITEREG_COUNT) + 9,  // number of registers written, plus 7 header bytes, plus 2 checksum bytes
-        .rx_length = 8                                     // fixed length ACK response?
-        // note: rx_length & tx_length must be less than or equal to MODBUS_MAX_ADU_SIZE
-    };
+        panel_stats.key_events++;
+        panel_stats.key_events_lost += ahead - 1;
+        key_events->seq = seq;
+        key_events->ack_due = true;
 
-    modbus_send(&write_cmd, &modbus_callbacks, block);
+        if ((key >> 4) < N_KEYDATAS) {
+            if (events[idx * 2 + 1] & PANEL_KEY_EVENT_PRESSED)
+                keydata[key >> 4] |= 1 << (key & 0x0F);
+            else
+                keydata[key >> 4] &= ~(1 << (key & 0x0F));
+            processKeypad(keydata);
+        }
+    }
 }
 
-static void rx_modbus_packet (modbus_message_t *msg)
+// NTP style clock filter, of the last PANEL_CLOCK_FILTER samples the one with the lowest delay sets the offset.
+// On Modbus the panel ticks are bracketed by the request round trip, CAN and UART only give the one way delay so
+// the offset includes the shortest transit time seen. Drift is from offset estimates PANEL_CLOCK_DRIFT_INTERVAL apart.
+static void clockSample (uint32_t panel_ms, uint32_t ctrl_ms, uint16_t delay)
 {
-    if(!(msg->adu[0] & 0x80)) {
+    panel_clock_t *clock = &panel->clock;
+    panel_clock_sample_t *best = NULL;
+    int32_t offset;
+
+    clock->samples[clock->next].panel_ms = panel_ms;
+    clock->samples[clock->next].ctrl_ms = ctrl_ms;
+    clock->samples[clock->next].delay = delay;
+    clock->next = (clock->next + 1) % PANEL_CLOCK_FILTER;
+    clock->count = min(clock->count + 1, PANEL_CLOCK_FILTER);
+
+    for (uint_fast8_t idx = 0; idx < clock->count; idx++) {
+        panel_clock_sample_t *sample = &clock->samples[idx];
+        if (best == NULL || sample->delay < best->delay ||
+             (sample->delay == best->delay && (int32_t)(sample->panel_ms - sample->ctrl_ms) > (int32_t)(best->panel_ms - best->ctrl_ms)))
+            best = sample;
+    }
 
-        switch((panel_modbus_response_t)msg->context) {
+    offset = (int32_t)(best->panel_ms - best->ctrl_ms);
 
-            case Panel_ReadInputRegisters:
-                encoder_data[0].raw_value = (msg->adu[7] << 8)  | msg->adu[8];      // Register 102
-                encoder_data[1].raw_value = (msg->adu[9] << 8)  | msg->adu[10];     // Register 103
-                encoder_data[2].raw_value = (msg->adu[11] << 8) | msg->adu[12];     // Register 104
-                encoder_data[3].raw_value = (msg->adu[13] << 8) | msg->adu[14];     // Register 105
-
-                keydata[0] = (msg->adu[15] << 8) | msg->adu[16];                    // Register 106
-                keydata[1] = (msg->adu[17] << 8) | msg->adu[18];                    // Register 107
-                keydata[2] = (msg->adu[19] << 8) | msg->adu[20];                    // Register 108
-                keydata[3] = (msg->adu[21] << 8) | msg->adu[22];                    // Register 109
-
-                processKeypad(keydata);
-
-                for (int i = 0; i < N_ENCODERS; i++) {
-                    processEncoder(i);
-                    // after first pass through, have populated the initial encoder values..
-                    encoder_data[i].init_ok = true;
-                }
-                break;
+    if (!clock->valid) {
+        clock->drift_offset = offset;
+        clock->drift_ms = best->ctrl_ms;
+    } else if (best->ctrl_ms - clock->drift_ms >= PANEL_CLOCK_DRIFT_INTERVAL) {
+        clock->drift += ((float)(offset - clock->drift_offset) / (float)(best->ctrl_ms - clock->drift_ms) - clock->drift) * 0.25f;
+        clock->drift_offset = offset;
+        clock->drift_ms = best->ctrl_ms;
+    }
 
-            case Panel_WriteHoldingRegisters:
-                break;
+    clock->offset = offset;
+    clock->ref_ms = best->ctrl_ms;
+    clock->delay = best->delay;
+    clock->valid = true;
+}
 
-            default:
-                break;
-        }
-    }
+// Timestamp an input sample in controller time from the panel ticks it was taken at
+static void clockInputSample (uint32_t panel_ms)
+{
+    panel_clock_t *clock = &panel->clock;
+    uint32_t ms = panel_ms - clock->offset;
 
+    clock->sample_ms = ms - (int32_t)(clock->drift * (float)(int32_t)(ms - clock->ref_ms));
+    clock->sample_valid = clock->valid;
 }
 
-static void rx_modbus_exception (uint8_t code, void *context)
+static void latencyRecord (uint32_t *histogram, uint32_t *max, uint32_t ms)
 {
-    // todo: need a 'Panel' alarm status
-    system_raise_alarm(Alarm_None);
+    uint_fast8_t bucket = 0;
+
+    while (bucket < PANEL_LATENCY_BUCKETS - 1 && ms >= (2UL << bucket))
+        bucket++;
+
+    histogram[bucket]++;
+    *max = max(*max, ms);
 }
-#endif // PANEL_ENABLE == 1
 
-#if PANEL_ENABLE == 2
-static canbus_message_t tx_message;
+#if PANEL_MODBUS || PANEL_CANBUS
+// Timestamp a realtime key sample taken without panel ticks, from the controller time it was taken at
+static void clockRealtimeSample (uint32_t ms)
+{
+    panel->clock.sample_ms = ms;
+    panel->clock.sample_valid = true;
+}
+#endif
 
-static bool panel_dequeue_rx (canbus_message_t message)
+// Press to enqueue latency, from the panel sample time of a new key press to it being processed.
+// Jog, cycle start & feed hold presses then wait for motion to start or stop, see onStateChange().
+static void latencyPress (bool motion)
 {
-    // process inbound data here..
-    //printf("panel_dequeue_rx(), CAN message id:%lx\n", message.id);
+    uint32_t ms = hal.get_elapsed_ticks();
 
-    // fixme: don't try accessing array elements that may not be allocated, respect N_KEYDATAS / N_ENCODERS etc..
+    if (!panel->clock.sample_valid)
+        return;
 
-    switch (message.id) {
-        case CANBUS_PANEL_KEYPAD_1:
-            keydata[0] = (message.data[0] << 8) | message.data[1];
-            keydata[1] = (message.data[2] << 8) | message.data[3];
-            keydata[2] = (message.data[4] << 8) | message.data[5];
-            keydata[3] = (message.data[6] << 8) | message.data[7];
+    latencyRecord(panel_stats.latency_enqueue, &panel_stats.latency_enqueue_max,
+                   (int32_t)(ms - panel->clock.sample_ms) > 0 ? ms - panel->clock.sample_ms : 0);
 
-            processKeypad(keydata);
-            break;
+    if (motion) {
+        panel->clock.press_ms = panel->clock.sample_ms;
+        panel->clock.motion_trace = true;
+    }
+}
 
-        case CANBUS_PANEL_KEYPAD_2:
-            keydata[4] = (message.data[0] << 8) | message.data[1];
-            keydata[5] = (message.data[2] << 8) | message.data[3];
+// New presses in the keypad data, the realtime keys are traced as they are processed
+static void latencyKeyPress (uint16_t keydata[])
+{
+    uint16_t pressed[4];
 
-            processKeypad(keydata);
-            break;
+    for (uint_fast8_t idx = 0; idx < 4; idx++)
+        pressed[idx] = keydata[idx] & ~panel->last_keydata[idx];
 
-        case CANBUS_PANEL_ENCODER_1:
-            encoder_data[0].raw_value = (message.data[0] << 8) | message.data[1];
-            encoder_data[1].raw_value = (message.data[2] << 8) | message.data[3];
-            encoder_data[2].raw_value = (message.data[4] << 8) | message.data[5];
-            encoder_data[3].raw_value = (message.data[6] << 8) | message.data[7];
-
-            for (int i = 0; i < 4; i++) {
-                processEncoder(i);
-                // after first pass through, have populated the initial encoder values..
-                encoder_data[i].init_ok = true;
-            }
-            break;
+    pressed[0] &= ~PANEL_LATENCY_REALTIME_KEYS;
 
-        // case CANBUS_PANEL_ENCODER_2:
-        //     encoder_data[4].raw_value = (message.data[0] << 8) | message.data[1];
-        //     encoder_data[5].raw_value = (message.data[2] << 8) | message.data[3];
-        //     encoder_data[6].raw_value = (message.data[4] << 8) | message.data[5];
-        //     encoder_data[7].raw_value = (message.data[6] << 8) | message.data[7];
-        //
-        //     for (int i = 4; i < 8; i++) {
-        //         processEncoder(i);
-        //         // after first pass through, have populated the initial encoder values..
-        //         encoder_data[i].init_ok = true;
-        //     }
-        //     break;
+    if (pressed[0] || pressed[1] || pressed[2] || pressed[3])
+        latencyPress(pressed[2] & PANEL_LATENCY_MOTION_KEYS_3);
+}
 
-        default:
-            break;
+// Queue a payload for the bulk channel, replacing any transfer in progress. Returns false if too long.
+bool panel_bulk_send (uint8_t id, const uint8_t *data, uint16_t length)
+{
+    if (length > PANEL_BULK_SIZE)
+        return false;
+
+    memcpy(bulk.data, data, length);
+    bulk.id = id;
+    bulk.length = length;
+    bulk.transfer++;
+    panel_stats.bulk_transfers++;
+
+    return true;
+}
+
+// Restart the panel's progress on a new payload, returns true if there is more to send
+static bool bulkPending (panel_bulk_progress_t *progress)
+{
+    if (progress->transfer != bulk.transfer) {
+        progress->transfer = bulk.transfer;
+        progress->offset = progress->chunk = 0;
     }
 
-    return(1);
+    return progress->offset < bulk.length;
 }
 
-void WriteCANbusOutputs()
+static inline uint32_t floatBits (const float32_data_t *data)
 {
-    static panel_displaydata_t displaydata;
+    uint32_t bits;
 
-    processDisplayData(&displaydata);
+    memcpy(&bits, data->bytes, sizeof(bits));
 
-    // State
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_STATE_1;
-    tx_message.len = 8;
-    tx_message.data[0] = 0;
-    tx_message.data[1] = 0;
-    tx_message.data[2] = (displaydata.grbl_state >> 8) & 0xFF;     // high byte
-    tx_message.data[3] = displaydata.grbl_state & 0xFF;            // low byte
-    tx_message.data[4] = (displaydata.spindle_speed >> 8) & 0xFF;  // high byte
-    tx_message.data[5] = displaydata.spindle_speed & 0xFF;         // low byte
-    tx_message.data[6] = (displaydata.spindle_load >> 8) & 0xFF;   // high byte
-    tx_message.data[7] = displaydata.spindle_load & 0xFF;          // low byte
-    canbus_queue_tx(tx_message, false);
+    return bits;
+}
 
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_STATE_2;
-    tx_message.len = 6;
-    tx_message.data[0] = displaydata.spindle_override;
-    tx_message.data[1] = displaydata.feed_override;
-    tx_message.data[2] = displaydata.rapid_override;
-    tx_message.data[3] = displaydata.wcs;
-    tx_message.data[4] = displaydata.mpg_mode;
-    tx_message.data[5] = displaydata.jog_mode;
-    canbus_queue_tx(tx_message, false);
+// Field packers generated from PANEL_DISPLAY_FIELDS. They are inlined with constant windows & frame ids,
+// so that the tests of fields not in the window or frame are resolved at compile time.
 
-    // Machine position - up to 8 axis supported
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_MPOS_1;
-    tx_message.len = 8;
-    tx_message.data[0] = (displaydata.position[0].bytes[1]);
-    tx_message.data[1] = (displaydata.position[0].bytes[0]);
-    tx_message.data[2] = (displaydata.position[0].bytes[3]);
-    tx_message.data[3] = (displaydata.position[0].bytes[2]);
-    tx_message.data[4] = (displaydata.position[1].bytes[1]);
-    tx_message.data[5] = (displaydata.position[1].bytes[0]);
-    tx_message.data[6] = (displaydata.position[1].bytes[3]);
-    tx_message.data[7] = (displaydata.position[1].bytes[2]);
-    canbus_queue_tx(tx_message, false);
+// A field lying within the register window
+static inline void packRegisterField (uint16_t *registers, uint16_t start, uint_fast8_t n_registers, uint16_t reg,
+                                       panel_field_byte_t byte, uint_fast8_t bits, uint32_t value)
+{
+    if (reg < start || reg + (bits > 16) >= start + n_registers)
+        return;
 
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_MPOS_2;
-    tx_message.len = 4;
-    tx_message.data[0] = (displaydata.position[2].bytes[1]);
-    tx_message.data[1] = (displaydata.position[2].bytes[0]);
-    tx_message.data[2] = (displaydata.position[2].bytes[3]);
-    tx_message.data[3] = (displaydata.position[2].bytes[2]);
-#if N_AXIS > 3
-    tx_message.len = 8;
-    tx_message.data[4] = (displaydata.position[3].bytes[1]);
-    tx_message.data[5] = (displaydata.position[3].bytes[0]);
-    tx_message.data[6] = (displaydata.position[3].bytes[3]);
-    tx_message.data[7] = (displaydata.position[3].bytes[2]);
-#endif
-    canbus_queue_tx(tx_message, false);
+    registers += reg - start;
+
+    if (bits > 16) {
+        registers[0] = value & 0xFFFF;          // low word first
+        registers[1] = value >> 16;
+    } else if (byte == PanelField_High)
+        registers[0] = (registers[0] & 0x00FF) | ((value & 0xFF) << 8);
+    else if (byte == PanelField_Low)
+        registers[0] = (registers[0] & 0xFF00) | (value & 0xFF);
+    else
+        registers[0] = value;
+}
 
-#if N_AXIS > 4
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_MPOS_3;
-    tx_message.len = 4;
-    tx_message.data[0] = (displaydata.position[4].bytes[1]);
-    tx_message.data[1] = (displaydata.position[4].bytes[0]);
-    tx_message.data[2] = (displaydata.position[4].bytes[3]);
-    tx_message.data[3] = (displaydata.position[4].bytes[2]);
-#if N_AXIS > 5
-    tx_message.len = 8;
-    tx_message.data[4] = (displaydata.position[5].bytes[1]);
-    tx_message.data[5] = (displaydata.position[5].bytes[0]);
-    tx_message.data[6] = (displaydata.position[5].bytes[3]);
-    tx_message.data[7] = (displaydata.position[5].bytes[2]);
-#endif
-    canbus_queue_tx(tx_message, false);
-#endif
+// Registers start to start + n_registers - 1, registers without a field are zeroed
+static inline void packRegisters (uint16_t *registers, uint16_t start, uint_fast8_t n_registers, panel_displaydata_t *displaydata, uint8_t format)
+{
+    memset(registers, 0, n_registers * sizeof(uint16_t));
 
-#if N_AXIS > 4
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_MPOS_4;
-    tx_message.len = 4;
-    tx_message.data[0] = (displaydata.position[4].bytes[1]);
-    tx_message.data[1] = (displaydata.position[4].bytes[0]);
-    tx_message.data[2] = (displaydata.position[4].bytes[3]);
-    tx_message.data[3] = (displaydata.position[4].bytes[2]);
-#if N_AXIS > 5
-    tx_message.len = 8;
-    tx_message.data[4] = (displaydata.position[5].bytes[1]);
-    tx_message.data[5] = (displaydata.position[5].bytes[0]);
-    tx_message.data[6] = (displaydata.position[5].bytes[3]);
-    tx_message.data[7] = (displaydata.position[5].bytes[2]);
-#endif
-    canbus_queue_tx(tx_message, false);
-#endif
+#define PANEL_FIELD(value, bits, reg, byte, can_id, can_byte) packRegisterField(registers, start, n_registers, reg, byte, bits, value);
+    PANEL_DISPLAY_FIELDS(PANEL_FIELD)
+#undef PANEL_FIELD
+}
+
+// The fields of a CAN frame, high byte first, returns the frame length
+static inline uint_fast8_t packCANbusFields (uint8_t *data, uint32_t id, panel_displaydata_t *displaydata, uint8_t format)
+{
+    uint_fast8_t length = 0;
+
+#define PANEL_FIELD(value, bits, reg, byte, can_id, can_byte) \
+    if (can_id == id) { \
+        uint32_t field = value; \
+        for (uint_fast8_t idx = bits / 8; idx; idx--, field >>= 8) \
+            data[can_byte + idx - 1] = field & 0xFF; \
+        length = max(length, can_byte + bits / 8); \
+    }
+    PANEL_DISPLAY_FIELDS(PANEL_FIELD)
+#undef PANEL_FIELD
+
+    return length;
+}
+
+#if PANEL_MODBUS || PANEL_UART
+
+// Capability block, input registers 90-94 as bytes, high byte first
+static void setCapabilityRegisters (const uint8_t *registers)
+{
+    uint8_t caps[8] = {
+        registers[1],                   // Register 90 low byte - protocol version
+        registers[2], registers[3],     // Register 91 - firmware major & minor
+        registers[5],                   // Register 92 low byte - firmware patch
+        registers[6], registers[7],     // Register 93 - keypad words & encoders
+        registers[8], registers[9]      // Register 94 - display axes & encodings
+    };
+
+    setCapabilities(caps);
+}
+
+// Apply a complete round of input registers
+static void processInputRegisters(void)
+{
+    uint_fast8_t n_keys = panel->caps.valid ? panel->caps.keys : N_KEYDATAS;
+    uint_fast8_t n_encoders = panel->caps.valid ? panel->caps.encoders : N_ENCODERS;
+
+    // Registers 100-101 - panel ticks, key events and levels below were sampled at this time
+    clockInputSample(((uint32_t)panel->input_registers[0] << 16) | panel->input_registers[1]);
+
+    // Register 116 - events in the FIFO, registers 117-120 - sequence number & key, edges before levels
+    if (panel->caps.valid && panel->caps.protocol >= PANEL_PROTOCOL_KEY_EVENTS) {
+        uint8_t events[PANEL_KEY_EVENTS * 2];
+        uint_fast8_t n_events = min(panel->input_registers[PANEL_MODBUS_READREG_COUNT] & 0xFF, PANEL_KEY_EVENTS);
+
+        for (uint_fast8_t idx = 0; idx < n_events; idx++) {
+            events[idx * 2] = panel->input_registers[PANEL_MODBUS_READREG_COUNT + 1 + idx] >> 8;
+            events[idx * 2 + 1] = panel->input_registers[PANEL_MODBUS_READREG_COUNT + 1 + idx] & 0xFF;
+        }
+        processKeyEvents(events, n_events);
+    }
+
+    for (int i = 0; i < n_keys; i++)
+        panel->keydata[i] = panel->input_registers[6 + i];                  // Registers 106-111
+
+    panel->keydata_rx_ms = hal.get_elapsed_ticks();
+
+    processKeypad(panel->keydata);
+
+    for (int i = 0; i < n_encoders; i++) {
+        panel->encoder_data[i].raw_value = panel->input_registers[i < 4 ? 2 + i : 12 + i - 4];   // Registers 102-105, 112-115
+        processEncoder(i);
+        // after first pass through, have populated the initial encoder values..
+        panel->encoder_data[i].init_ok = true;
+    }
+}
+
+// Registers 100 to 106 - state, spindle, overrides & modes
+static void packStateRegisters(uint16_t *registers, panel_displaydata_t *displaydata, uint8_t format)
+{
+    packRegisters(registers, PANEL_MODBUS_START_REG, 7, displaydata, format);
+}
+
+// Registers 140 to 143 - medium rate display data
+static void packMediumRegisters(uint16_t *registers, panel_displaydata_t *displaydata)
+{
+    packRegisters(registers, PANEL_MODBUS_MEDIUM_REG, PANEL_MODBUS_MEDIUM_COUNT, displaydata, 0);
+}
+
+// Registers 150 to 154 - slow rate display data
+static void packSlowRegisters(uint16_t *registers, panel_displaydata_t *displaydata)
+{
+    packRegisters(registers, PANEL_MODBUS_SLOW_REG, PANEL_MODBUS_SLOW_COUNT, displaydata, 0);
+}
+
+// Registers 200 onwards - bulk channel chunk header followed by the data, two bytes per register
+static void packBulkRegisters(uint16_t *registers, uint16_t offset, uint_fast16_t n_bytes)
+{
+    registers[0] = (bulk.id << 8) | bulk.transfer;                          // Register 200
+    registers[1] = bulk.length;                                             // Register 201
+    registers[2] = offset;                                                  // Register 202
+    registers[3] = n_bytes;                                                 // Register 203
+    for (uint_fast16_t idx = 0; idx < n_bytes; idx += 2)                    // Registers 204 onwards
+        registers[PANEL_MODBUS_BULK_HEADER + idx / 2] = (bulk.data[offset + idx] << 8) |
+                                                         (idx + 1 < n_bytes ? bulk.data[offset + idx + 1] : 0);
+}
+
+#endif // PANEL_MODBUS || PANEL_UART
+
+#if PANEL_CANBUS || PANEL_UART
+
+// Inputs pushed by the panel, the link is up while they keep arriving
+static bool pushedLinkOk (void)
+{
+    return panel->keydata_rx_ms && hal.get_elapsed_ticks() - panel->keydata_rx_ms < PANEL_LINK_TIMEOUT;
+}
+
+static uint32_t pushedInputPeriod (void)
+{
+    return poll_base_interval;
+}
+
+#endif // PANEL_CANBUS || PANEL_UART
+
+#if PANEL_MODBUS
+static void rx_modbus_packet (modbus_message_t *msg);
+static void rx_modbus_exception (uint8_t code, void *context);
+static void WriteModbusKeyEventAck(void);
+static uint32_t modbusInputPeriod(void);
+
+static const modbus_callbacks_t modbus_callbacks = {
+    .on_rx_packet = rx_modbus_packet,
+    .on_rx_exception = rx_modbus_exception
+};
+
+// The panel usually shares the Modbus port with a VFD, so panel traffic is budgeted per input period from
+// the baud rate and frame sizes. Realtime keys, inputs and VFD requests are always sent but count against
+// the budget, regular display writes are reduced or skipped when it is exhausted.
+static panel_bus_t bus = { 0 };
+
+// Bus time for a request and its response, including the 3.5 character silent interval before each (us)
+static uint32_t busFrameTime (uint_fast8_t tx_length, uint_fast8_t rx_length)
+{
+    return ((uint32_t)(tx_length + rx_length) * 2 + 2 * 7) * PANEL_MODBUS_CHAR_BITS * 500000UL / PANEL_MODBUS_BAUD;
+}
+
+static void busCycle (uint32_t ms)
+{
+    uint32_t period = modbusInputPeriod();
+
+    if (ms - bus.cycle_start_ms < period)
+        return;
+
+    panel_stats.bus_utilisation = min(bus.used_us / (period * 10), 255);
+    panel_stats.bus_utilisation_max = max(panel_stats.bus_utilisation_max, panel_stats.bus_utilisation);
+
+    // Saturated if the inputs take longer than the update interval to come back, or the panel share is used up.
+    // The interval before the backoff is applied, as the backed off one would release the backoff it caused.
+    uint16_t rtt = 0;
+    panel_instance_t *modbus_panel;
+    for (uint_fast8_t n = 0; (modbus_panel = transportPanel(&modbus_transport, n)); n++)
+        rtt = max(rtt, modbus_panel->transactions[Panel_ReadInputRegisters].rtt_last);
+
+    if (rtt >= poll_base_interval || panel_stats.bus_utilisation >= PANEL_MODBUS_BUS_SHARE) {
+        if (poll_backoff < PANEL_POLL_MAX_BACKOFF)
+            poll_backoff++;
+    } else if (poll_backoff > 1 && rtt < poll_base_interval / 2 && panel_stats.bus_utilisation < PANEL_MODBUS_BUS_SHARE / 2)
+        poll_backoff--;
+
+    bus.cycle_start_ms = ms;
+    bus.used_us = 0;
+    bus.budget_us = period * 10 * PANEL_MODBUS_BUS_SHARE;
+
+    // responses lost without a callback, don't hold display writes back forever
+    if (bus.outstanding && ms - bus.last_tx_ms > PANEL_MODBUS_TX_TIMEOUT)
+        bus.outstanding = 0;
+}
+
+#if VFD_ENABLE
+// Bus time used by requests the panel does not send itself, i.e. the VFD. This is an estimate only, a read
+// for RPM and one for load per spindle data refresh, charged so panel writes are reduced to leave room.
+// VFD requests are not scheduled or held back by the panel.
+static void busAccount (uint32_t us)
+{
+    busCycle(hal.get_elapsed_ticks());
+    bus.used_us += us;
+}
+#endif
+
+static bool busAvailable (uint_fast8_t tx_length, uint_fast8_t rx_length)
+{
+    busCycle(hal.get_elapsed_ticks());
+
+    return bus.outstanding < PANEL_MODBUS_MAX_OUTSTANDING && bus.used_us + busFrameTime(tx_length, rx_length) <= bus.budget_us;
+}
+
+static void busResponse (void)
+{
+    if (bus.outstanding)
+        bus.outstanding--;
+}
+
+static const char *const transaction_names[Panel_ResponseCount] = {
+    "", "INPUTS", "DISPLAY", "RTKEYS", "", "MEDIUM", "SLOW", "STATE", "CAPS", "EVACK", "BULK"
+};
+
+// Keyframe writes are regular display writes with a different completion action
+static panel_modbus_response_t txSlot (panel_modbus_response_t type)
+{
+    return type == Panel_WritePositionKeyframe ? Panel_WriteHoldingRegisters : type;
+}
+
+// Start tracking a request, returns false if one of the same type is still outstanding
+static bool txBegin (modbus_message_t *msg)
+{
+    panel_modbus_response_t type = (panel_modbus_response_t)((uintptr_t)msg->context & 0xFF);
+    panel_modbus_tx_t *tx = &panel->transactions[txSlot(type)];
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if (tx->pending) {
+        if (ms - tx->sent_ms < PANEL_MODBUS_TX_TIMEOUT) {
+            tx->refused++;
+            return false;
+        }
+        tx->timeouts++;
+        busResponse();
+    }
+
+    tx->pending = true;
+    tx->sent_ms = ms;
+    tx->seq++;
+    msg->context = (void *)(((uintptr_t)panel->index << 16) | ((uintptr_t)tx->seq << 8) | type);
+
+    return true;
+}
+
+// Match a reply or exception to its request and select the panel it came from,
+// returns the request type or Panel_Idle if stale
+static panel_modbus_response_t txEnd (void *context)
+{
+    panel_modbus_response_t type = (panel_modbus_response_t)((uintptr_t)context & 0xFF);
+    uint_fast8_t instance = ((uintptr_t)context >> 16) & 0xFF;
+    panel_modbus_tx_t *tx;
+
+    if (type == Panel_Idle || type >= Panel_ResponseCount || instance >= PANEL_INSTANCES)
+        return Panel_Idle;
+
+    panel = &panels[instance];
+
+    tx = &panel->transactions[txSlot(type)];
+
+    if (!tx->pending || tx->seq != (uint8_t)((uintptr_t)context >> 8)) {
+        tx->stale++;
+        return Panel_Idle;
+    }
+
+    tx->pending = false;
+    tx->rtt_last = min(hal.get_elapsed_ticks() - tx->sent_ms, 0xFFFF);
+    tx->rtt_max = max(tx->rtt_max, tx->rtt_last);
+    tx->completed++;
+    busResponse();
+
+    return type;
+}
+
+// Back-to-back polling, the next transaction of the update cycle follows a reply after the inter-frame gap
+static void busReplied (void)
+{
+    if (panel_settings.bus_duty) {
+        bus.next_due = true;
+        bus.next_held = false;
+        bus.next_ms = hal.get_elapsed_ticks() + PANEL_MODBUS_FRAME_GAP_MS;
+    }
+}
+
+// Due once the gap has passed and the bus is clear, held back while the bus time used this period is over the duty cap
+static bool busNextDue (uint32_t ms)
+{
+    if (!bus.next_due || (int32_t)(ms - bus.next_ms) < 0 || bus.outstanding)
+        return false;
+
+    busCycle(ms);
+
+    if (bus.used_us > (ms - bus.cycle_start_ms) * 10 * panel_settings.bus_duty) {
+        if (!bus.next_held)
+            panel_stats.poll_duty_limited++;
+        bus.next_held = true;
+        return false;
+    }
+
+    bus.next_due = false;
+    panel_stats.poll_back_to_back++;
+
+    return true;
+}
+
+static bool busSend (modbus_message_t *msg, bool block, panel_bus_priority_t priority)
+{
+    if (priority == PanelBus_Display && !busAvailable(msg->tx_length, msg->rx_length))
+        return false;
+
+    if (!txBegin(msg))
+        return false;
+
+    // counted before sending, as a blocking send completes before returning
+    bus.outstanding++;
+    bus.last_tx_ms = hal.get_elapsed_ticks();
+    bus.used_us += busFrameTime(msg->tx_length, msg->rx_length);
+
+    if (!modbus_send(msg, &modbus_callbacks, block)) {
+        panel->transactions[txSlot((uintptr_t)msg->context & 0xFF)].pending = false;
+        bus.outstanding--;
+        return false;
+    }
+
+    return true;
+}
+
+// Input registers from 100 are read in as many chunks as the ADU size allows, one chunk per input update.
+// Encoders and keys are only updated once all the chunks of a round have been received.
+
+// Display data is written to the holding registers from 100 in the same way, from a snapshot taken at the
+// start of each round. The panel should apply the display data when the chunk with the last register arrives.
+
+// Size the input reads to the keys & encoders the panel has. Keypad words are in registers 106-111, encoders
+// in 102-105, then 112-115, followed by the key events from 116 if the panel latches them. The panel tick
+// registers 100-101 are always read, for the clock synchronisation.
+static void sizeInputRegisters (void)
+{
+    panel->input_chunks.start = 0;
+
+    if (!panel->caps.valid)
+        panel->input_chunks.n_registers = PANEL_MODBUS_READREG_COUNT;
+    else if (panel->caps.protocol >= PANEL_PROTOCOL_KEY_EVENTS)
+        panel->input_chunks.n_registers = PANEL_MODBUS_INPUT_REGS;
+    else {
+        panel->input_chunks.n_registers = panel->caps.encoders > 4 ? 12 + panel->caps.encoders - 4
+                                                           : (panel->caps.keys ? 6 + panel->caps.keys : 2 + panel->caps.encoders);
+    }
+
+    panel->input_chunks.next = panel->input_chunks.start;
+}
+
+static uint_fast8_t inputChunks (void)
+{
+    return max((panel->input_chunks.n_registers - panel->input_chunks.start + PANEL_MODBUS_MAX_READREGS - 1) / PANEL_MODBUS_MAX_READREGS, 1);
+}
+
+static uint8_t panelAddress (void)
+{
+#if PANEL_INSTANCES > 1
+    if (panel->index)
+        return panel_settings.panel2_modbus_address;
+#endif
+    return panel_settings.modbus_address;
+}
+
+// Capability block, input registers 90-94. Byte layout as the CAN CAPS frame:
+// protocol, firmware major, minor, patch, keypad words, encoders, display axes, encodings.
+static void ReadModbusCapabilities(void)
+{
+    modbus_message_t read_cmd = {
+        .context = (void *)Panel_ReadCapabilities,
+        .crc_check = true,
+        .adu[0] = panelAddress(),
+        .adu[1] = ModBus_ReadInputRegisters,
+        .adu[2] = 0x00,                                 // Start address   - high byte
+        .adu[3] = PANEL_MODBUS_CAPS_REG,                // Start address   - low byte - 90 (0x5A)
+        .adu[4] = 0x00,                                 // No of registers - high byte
+        .adu[5] = PANEL_MODBUS_CAPS_COUNT,              // No of registers - low byte
+        .tx_length = 8,
+        .rx_length = (2*PANEL_MODBUS_CAPS_COUNT) + 5
+    };
+
+    panel->caps.address = panelAddress();
+
+    busSend(&read_cmd, false, PanelBus_Priority);
+}
+
+static void ReadModbusInputRegisters(bool block)
+{
+    // Probe the panel first, and again if its address changes
+    if (panel->caps.probed && panel->caps.address != panelAddress()) {
+        memset(&panel->caps, 0, sizeof(panel_caps_t));
+        memset(&panel->key_events, 0, sizeof(panel_key_events_t));
+        sizeInputRegisters();
+    }
+
+    // repeated with each round until the panel has accepted it
+    if (panel->key_events.ack_due)
+        WriteModbusKeyEventAck();
+
+    if (panelProbe())
+        return;
+
+    if (panel->input_chunks.n_registers <= panel->input_chunks.start)
+        return;                     // nothing to read
+
+    uint_fast8_t n_registers = min(panel->input_chunks.n_registers - panel->input_chunks.next, PANEL_MODBUS_MAX_READREGS);
+    uint16_t start_reg = PANEL_MODBUS_START_REG + panel->input_chunks.next;
+
+    modbus_message_t read_cmd = {
+        .context = (void *)Panel_ReadInputRegisters,
+        .crc_check = true,
+        .adu[0] = panelAddress(),
+        .adu[1] = ModBus_ReadInputRegisters,
+        .adu[2] = (start_reg >> 8) & 0xFF,              // Start address   - high byte
+        .adu[3] = start_reg & 0xFF,                     // Start address   - low byte - 100 (0x64) for the first chunk
+        .adu[4] = 0x00,                                 // No of registers - high byte
+        .adu[5] = n_registers,                          // No of registers - low byte
+        .tx_length = 8,                                 // number of registers, plus 2 checksum bytes
+        .rx_length = (2*n_registers) + 5                // number of data registers requested,
+                                                        // plus 3 header bytes (address, function, length),
+                                                        // plus 2 checksum bytes
+         // note: rx_length & tx_length must be less than or equal to MODBUS_MAX_ADU_SIZE
+    };
+
+    panel->input_chunks.chunk = n_registers;
+
+    busSend(&read_cmd, block, PanelBus_Priority);
+}
+
+// Short read of the realtime keys only, so that stop/feed hold/reset don't wait for the full input block
+static void ReadModbusRealtimeKeys(void)
+{
+    modbus_message_t read_cmd = {
+        .context = (void *)Panel_ReadRealtimeKeys,
+        .crc_check = true,
+        .adu[0] = panelAddress(),
+        .adu[1] = ModBus_ReadInputRegisters,
+        .adu[2] = 0x00,                                 // Start address   - high byte
+        .adu[3] = PANEL_MODBUS_REALTIME_REG,            // Start address   - low byte - 106 (0x6A)
+        .adu[4] = 0x00,                                 // No of registers - high byte
+        .adu[5] = 1,                                    // No of registers - low byte
+        .tx_length = 8,
+        .rx_length = 7                                  // 1 data register, plus 3 header bytes, plus 2 checksum bytes
+    };
+
+    // not stacked if the bus is slow to respond, see txBegin()
+    busSend(&read_cmd, false, PanelBus_Priority);
+}
+
+// Write a contiguous block of 16 bit holding registers, returns false if not sent
+static bool WriteModbusWindow(panel_modbus_response_t type, uint16_t start_reg, const uint16_t *registers, uint_fast8_t n_registers,
+                               panel_bus_priority_t priority, bool block)
+{
+    modbus_message_t write_cmd = {
+        .context = (void *)type,
+        .crc_check = true,
+        .adu[0] = panelAddress(),
+        .adu[1] = ModBus_WriteRegisters,
+        .adu[2] = (start_reg >> 8) & 0xFF,                      // Start address - high byte
+        .adu[3] = start_reg & 0xFF,                             // Start address - low byte
+        .adu[4] = 0x00,                                         // No of 16bit registers - high byte
+        .adu[5] = n_registers,                                  // No of 16bit registers - low byte
+        .adu[6] = n_registers*2,                                // Number of bytes
+        .tx_length = (2*n_registers) + 9,                       // number of registers written, plus 7 header bytes, plus 2 checksum bytes
+        .rx_length = 8                                          // fixed length ACK response
+        // note: rx_length & tx_length must be less than or equal to MODBUS_MAX_ADU_SIZE
+    };
+
+    for (uint_fast8_t idx = 0; idx < n_registers; idx++) {
+        write_cmd.adu[7 + idx*2] = (registers[idx] >> 8) & 0xFF;
+        write_cmd.adu[8 + idx*2] = registers[idx] & 0xFF;
+    }
+
+    return busSend(&write_cmd, block, priority);
+}
+
+// Snapshot the display data into the holding register image at the start of a round,
+// returns false if the round is skipped as the bus budget is exhausted
+static bool buildDisplayRegisters(bool block)
+{
+    panel_displaydata_t *displaydata = &panel_displaydata;
+    uint16_t *position = &panel->display_registers[7];
+    uint_fast8_t n_position, n_axis;
+    uint8_t format, classes = processDisplayData(displaydata, displayClassesDue(hal.get_elapsed_ticks()));
+
+    // legacy register count for float positions, otherwise all axes
+    n_position = packPositionWords(position, displaydata, displaydata->position_format == PositionFormat_Float
+                                                           ? PANEL_MODBUS_WRITEREG_COUNT - 7
+                                                           : N_AXIS * 2);
+    n_axis = (displaydata->position_frame & PANEL_POSITION_FRAME_DELTA) ? n_position : n_position / 2;
+    format = displaydata->position_format;
+
+    // Skip the round if the bus budget is exhausted, but not so often that the display stalls
+    if (!block && !busAvailable(2 * min(7 + n_position, PANEL_MODBUS_MAX_WRITEREGS) + 9, 8)) {
+        if (bus.skipped < PANEL_MODBUS_MAX_SKIPS) {
+            bus.skipped++;
+            panel_stats.bus_display_skipped++;
+            if (classes & PanelRate_Slow)
+                panel->slow_due = true;
+            panel->rate_sent.medium_valid = panel->rate_sent.slow_valid = false;
+            return false;
+        }
+        panel_stats.bus_display_shrunk++;
+    }
+    bus.skipped = 0;
+
+    // followed by the sample time and a velocity per axis, if the bus budget allows
+    if (panelVelocity() && (block || busAvailable(2 * min(7 + n_position + 1 + n_axis, PANEL_MODBUS_MAX_WRITEREGS) + 9, 8))) {
+        position[n_position++] = displaydata->sample_ms;
+        for (uint_fast8_t idx = 0; idx < n_axis; idx++)
+            position[n_position++] = (uint16_t)displaydata->velocity[idx];
+        format |= PANEL_POSITION_FORMAT_VELOCITY;
+    }
+
+    packStateRegisters(panel->display_registers, displaydata, format);
+
+    panel->display_chunks.n_registers = 7 + n_position;
+    panel->display_chunks.next = 0;
+    // delta format keyframes need to be acknowledged before deltas can be sent relative to them
+    panel->display_chunks.keyframe = displaydata->position_format == PositionFormat_Delta && !(displaydata->position_frame & PANEL_POSITION_FRAME_DELTA);
+    panel->display_chunks.keyframe_id = displaydata->position_frame;
+
+    // Medium and slow rate data in their own register windows, only when due and the budget allows
+    if (classes & PanelRate_Medium) {
+        uint16_t registers[PANEL_MODBUS_MEDIUM_COUNT];
+        packMediumRegisters(registers, displaydata);
+        if (!WriteModbusWindow(Panel_WriteMediumRegisters, PANEL_MODBUS_MEDIUM_REG, registers, PANEL_MODBUS_MEDIUM_COUNT, PanelBus_Display, false))
+            panel->rate_sent.medium_valid = false;     // send with the next medium rate update
+    }
+
+    if (classes & PanelRate_Slow) {
+        uint16_t registers[PANEL_MODBUS_SLOW_COUNT];
+        packSlowRegisters(registers, displaydata);
+        if (!WriteModbusWindow(Panel_WriteSlowRegisters, PANEL_MODBUS_SLOW_REG, registers, PANEL_MODBUS_SLOW_COUNT, PanelBus_Display, false)) {
+            panel->slow_due = true;    // retry with the next update
+            panel->rate_sent.slow_valid = false;
+        }
+    }
+
+    return true;
+}
+
+// Registers 100 onwards - state, then axis positions in the selected format, optionally followed by
+// sample time & velocities. The next chunk is only sent once the previous one has been acknowledged.
+static void WriteModbusHoldingRegisters(bool block)
+{
+    uint_fast8_t n_registers;
+    panel_modbus_response_t type = Panel_WriteHoldingRegisters;
+
+    if (panel->display_chunks.next >= panel->display_chunks.n_registers && !buildDisplayRegisters(block))
+        return;
+
+    n_registers = min(panel->display_chunks.n_registers - panel->display_chunks.next, PANEL_MODBUS_MAX_WRITEREGS);
+
+    // keyframe is acknowledged with the last chunk, earlier chunks have been acknowledged by then
+    if (panel->display_chunks.keyframe && panel->display_chunks.next + n_registers == panel->display_chunks.n_registers)
+        type = Panel_WritePositionKeyframe;
+
+    panel->display_chunks.chunk = n_registers;
+
+    WriteModbusWindow(type, PANEL_MODBUS_START_REG + panel->display_chunks.next, &panel->display_registers[panel->display_chunks.next], n_registers,
+                       PanelBus_Priority, block);
+}
+
+// Minimal out of cycle write of the state registers only, positions follow with the next regular update.
+// Note the position format & frame in register 101 are those of the last positions sent.
+static void WriteModbusStateRegisters(void)
+{
+    uint16_t registers[7];
+
+    processStateData(&panel_displaydata);
+    processOverrideData(&panel_displaydata);
+    packStateRegisters(registers, &panel_displaydata, panel->display_registers[1] >> 8);
+
+    WriteModbusWindow(Panel_WriteStateRegisters, PANEL_MODBUS_START_REG, registers, 7, PanelBus_Priority, false);
+}
+
+// Register 160 - sequence number of the last key event processed, the panel drops events up to and including it
+static void WriteModbusKeyEventAck(void)
+{
+    uint16_t registers[1] = { panel->key_events.seq };
+
+    WriteModbusWindow(Panel_WriteKeyEventAck, PANEL_MODBUS_EVENT_ACK_REG, registers, 1, PanelBus_Priority, false);
+}
+
+// Registers 200 onwards - bulk channel chunk: id & transfer, total length, offset and chunk length in bytes,
+// then the data two bytes per register, high byte first. Only sent in spare bus time, when nothing is
+// outstanding and the chunk can be transferred before the next poll is due.
+static bool WriteModbusBulk(uint32_t ms, uint32_t poll_due_ms)
+{
+    panel_bulk_progress_t *progress = &panel->bulk;
+    uint16_t registers[PANEL_MODBUS_MAX_WRITEREGS];
+    uint_fast16_t n_bytes;
+    uint_fast8_t n_registers;
+
+    if (!bulkPending(progress) || bus.outstanding || bus.next_due)
+        return false;
+
+    n_bytes = min(bulk.length - progress->offset, (PANEL_MODBUS_MAX_WRITEREGS - PANEL_MODBUS_BULK_HEADER) * 2);
+    n_registers = PANEL_MODBUS_BULK_HEADER + (n_bytes + 1) / 2;
+
+    if ((int32_t)(poll_due_ms - ms) * 1000L < (int32_t)busFrameTime(2 * n_registers + 9, 8))
+        return false;
+
+    packBulkRegisters(registers, progress->offset, n_bytes);
+
+    if (!WriteModbusWindow(Panel_WriteBulk, PANEL_MODBUS_BULK_REG, registers, n_registers, PanelBus_Display, false))
+        return false;
+
+    if (progress->chunk)
+        panel_stats.bulk_resumed++;     // previous chunk was not acknowledged
+    progress->chunk = n_bytes;
+    panel_stats.bulk_chunks++;
+
+    return true;
+}
+
+// Registers asked for by a read request
+static uint_fast8_t modbusReadCount (panel_modbus_response_t type)
+{
+    switch (type) {
+        case Panel_ReadInputRegisters:
+            return panel->input_chunks.chunk;
+        case Panel_ReadCapabilities:
+            return PANEL_MODBUS_CAPS_COUNT;
+        case Panel_ReadRealtimeKeys:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void processModbusPacket (modbus_message_t *msg)
+{
+    // late replies to timed out requests are dropped rather than applied as fresh data
+    panel_modbus_response_t type = txEnd(msg->context);
+
+    if(type != Panel_Idle && !(msg->adu[0] & 0x80)) {
+
+        // replies to reads carry a byte count, replies not matching the registers asked for are dropped
+        if (msg->adu[1] == ModBus_ReadInputRegisters && msg->adu[2] != 2 * modbusReadCount(type)) {
+            panel->transactions[type].malformed++;
+            return;
+        }
+
+        switch(type) {
+
+            case Panel_ReadInputRegisters:
+                for (uint_fast8_t idx = 0; idx < panel->input_chunks.chunk; idx++)
+                    panel->input_registers[panel->input_chunks.next + idx] = (msg->adu[3 + idx*2] << 8) | msg->adu[4 + idx*2];
+
+                // Registers 100-101 - panel ticks, taken somewhere within the request round trip
+                if (panel->input_chunks.next == 0 && panel->input_chunks.chunk >= 2) {
+                    uint16_t rtt = panel->transactions[Panel_ReadInputRegisters].rtt_last;
+                    clockSample(((uint32_t)panel->input_registers[0] << 16) | panel->input_registers[1], hal.get_elapsed_ticks() - rtt / 2, rtt);
+                }
+
+                if ((panel->input_chunks.next += panel->input_chunks.chunk) >= panel->input_chunks.n_registers) {
+                    panel->input_chunks.next = panel->input_chunks.start;
+                    processInputRegisters();
+                }
+                busReplied();
+                break;
+
+            case Panel_WriteHoldingRegisters:
+                panel->display_chunks.next += panel->display_chunks.chunk;
+                busReplied();
+                break;
+
+            case Panel_WritePositionKeyframe:
+                panel->display_chunks.next += panel->display_chunks.chunk;
+                positionKeyframeAcknowledged(panel->display_chunks.keyframe_id);
+                busReplied();
+                break;
+
+            case Panel_ReadCapabilities:
+                setCapabilityRegisters(&msg->adu[3]);
+                sizeInputRegisters();
+                break;
+
+            case Panel_ReadRealtimeKeys:
+                clockRealtimeSample(hal.get_elapsed_ticks() - panel->transactions[Panel_ReadRealtimeKeys].rtt_last / 2);
+                processRealtimeKeys((msg->adu[3] << 8) | msg->adu[4]);              // Register 106
+                break;
+
+            case Panel_WriteKeyEventAck:
+                panel->key_events.ack_due = false;
+                break;
+
+            case Panel_WriteBulk:
+                panel->bulk.offset += panel->bulk.chunk;
+                panel->bulk.chunk = 0;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+}
+
+static void processModbusException (uint8_t code, void *context)
+{
+    panel_modbus_response_t type = txEnd(context);
+
+    if (type == Panel_Idle || type == Panel_ReadRealtimeKeys)
+        return;
+
+    // restart the round, chunks already transferred may be inconsistent with the rest
+    if (type == Panel_ReadInputRegisters)
+        panel->input_chunks.next = panel->input_chunks.start;
+    else if (type == Panel_ReadCapabilities || type == Panel_WriteBulk)
+        return;                     // legacy panel, capabilities retried up to PANEL_CAPS_ATTEMPTS, bulk chunks resent
+    else if (type == Panel_WriteHoldingRegisters || type == Panel_WritePositionKeyframe)
+        panel->display_chunks.next = panel->display_chunks.n_registers = 0;
+
+    // todo: need a 'Panel' alarm status
+    system_raise_alarm(Alarm_None);
+}
+
+// Replies are processed for the panel they came from, see txEnd()
+static void rx_modbus_packet (modbus_message_t *msg)
+{
+    panel_instance_t *current = panel;
+
+    processModbusPacket(msg);
+    panel = current;
+}
+
+static void rx_modbus_exception (uint8_t code, void *context)
+{
+    panel_instance_t *current = panel;
+
+    processModbusException(code, context);
+    panel = current;
+}
+
+static void ReadModbusInputs(void)
+{
+    ReadModbusInputRegisters(false);      // do not block for modbus response
+}
+
+static void WriteModbusOutputs(void)
+{
+    WriteModbusHoldingRegisters(false);   // do not block for modbus response
+}
+
+static bool modbusLinkOk (void)
+{
+    panel_modbus_tx_t *tx = &panel->transactions[Panel_ReadInputRegisters];
+
+    return tx->completed && !(tx->pending && hal.get_elapsed_ticks() - tx->sent_ms >= PANEL_MODBUS_TX_TIMEOUT);
+}
+
+static uint32_t modbusInputPeriod (void)
+{
+    return poll_interval * 2 * inputChunks() * max(transportPanels(&modbus_transport), 1);  // inputs and outputs are interleaved, panels take turns
+}
+
+static const panel_transport_t modbus_transport = {
+    .name = "MODBUS",
+    .polled = true,
+    .poll = ReadModbusInputs,
+    .publish = WriteModbusOutputs,
+    .event = WriteModbusStateRegisters,
+    .capabilities = ReadModbusCapabilities,
+    .link_ok = modbusLinkOk,
+    .input_period = modbusInputPeriod
+};
+#endif // PANEL_MODBUS
+
+#if PANEL_CANBUS
+static canbus_message_t tx_message;
+
+// Frames carry 16 bit panel ticks, extended to 32 bits from the current clock estimate
+static void clockCANbusTicks (uint16_t ticks)
+{
+    uint32_t ms = hal.get_elapsed_ticks(), panel_ms = ticks;
+
+    if (panel->clock.valid) {
+        uint32_t predicted = ms + panel->clock.offset;
+        panel_ms = predicted + (int16_t)(ticks - (uint16_t)predicted);
+    }
+
+    clockSample(panel_ms, ms, 0);
+    clockInputSample(panel_ms);
+}
+
+// Apply a snapshot of the input frames, processing the keypad and encoders once per panel cycle
+static void commitCANbusSnapshot (uint8_t frames)
+{
+    panel_can_snapshot_t *snapshot = &panel->can_snapshot;
+
+    if (frames & (PanelFrame_Keypad1 | PanelFrame_Keypad2)) {
+        memcpy(panel->keydata, snapshot->keydata, sizeof(panel->keydata));
+        panel->keydata_rx_ms = hal.get_elapsed_ticks();
+        processKeypad(panel->keydata);
+    }
+
+    for (int i = 0; i < N_ENCODERS; i++) {
+        if (frames & (i < 4 ? PanelFrame_Encoder1 : PanelFrame_Encoder2)) {
+            panel->encoder_data[i].raw_value = snapshot->encoder[i];
+            processEncoder(i);
+            // after first pass through, have populated the initial encoder values..
+            panel->encoder_data[i].init_ok = true;
+        }
+    }
+
+    panel_stats.can_snapshots++;
+}
+
+// Shortest valid length of the panel input frames
+static uint_fast8_t canbusInputLength (uint32_t id)
+{
+    switch (id) {
+        case CANBUS_PANEL_REALTIME:
+        case CANBUS_PANEL_ENCODER_1:
+        case CANBUS_PANEL_ENCODER_2:
+            return 2;
+        case CANBUS_PANEL_KEYPAD_2:
+            return 4;
+        case CANBUS_PANEL_KEYPAD_1:
+        case CANBUS_PANEL_CAPS:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+// Panels that report a protocol version with sequenced cycles commit their input frames with KEYPAD_2,
+// others, and panels not yet probed, have each frame processed as it arrives
+static inline bool canbusSequenced (void)
+{
+    return panel->caps.valid && panel->caps.protocol >= PANEL_PROTOCOL_CAN_CYCLES;
+}
+
+static bool processCANbusMessage (canbus_message_t message)
+{
+    panel_can_snapshot_t *snapshot = &panel->can_snapshot;
+
+    if (message.len < canbusInputLength(message.id)) {
+        panel_stats.can_malformed++;
+        return(1);
+    }
+
+    // a panel silent for the link timeout may have restarted, resync on its next cycle
+    if (snapshot->seq_valid && hal.get_elapsed_ticks() - panel->keydata_rx_ms >= PANEL_LINK_TIMEOUT) {
+        snapshot->seq_valid = false;
+        snapshot->received = 0;
+    }
+
+    switch (message.id) {
+        // realtime keys first, these bypass the rest of the panel processing
+        case CANBUS_PANEL_REALTIME:
+            clockRealtimeSample(hal.get_elapsed_ticks());
+            processRealtimeKeys((message.data[0] << 8) | message.data[1]);
+            break;
+
+        case CANBUS_PANEL_KEYPAD_1:
+            snapshot->keydata[0] = (message.data[0] << 8) | message.data[1];
+            snapshot->keydata[1] = (message.data[2] << 8) | message.data[3];
+            snapshot->keydata[2] = (message.data[4] << 8) | message.data[5];
+            snapshot->keydata[3] = (message.data[6] << 8) | message.data[7];
+            snapshot->received |= PanelFrame_Keypad1;
+            // buffered only, the keypad is processed once per cycle with KEYPAD_2
+            break;
+
+        case CANBUS_PANEL_KEYPAD_2:
+            snapshot->keydata[4] = (message.data[0] << 8) | message.data[1];
+            snapshot->keydata[5] = (message.data[2] << 8) | message.data[3];
+            snapshot->received |= PanelFrame_Keypad2;
+
+            // bytes 6/7 - low 16 bits of the panel ticks when the cycle was sampled
+            if (message.len >= 8)
+                clockCANbusTicks((message.data[6] << 8) | message.data[7]);
+
+            // legacy panels don't number their cycles, KEYPAD_2 is the last keypad frame of each, so
+            // commit it with the latest KEYPAD_1 words for a single processKeypad() per cycle
+            if (!canbusSequenced()) {
+                commitCANbusSnapshot(PanelFrame_Keypad2);
+                snapshot->received = 0;
+            } else if (message.len >= 6) {
+                uint8_t seq = message.data[4], mask = message.data[5] | PanelFrame_Keypad2;
+
+                if (snapshot->seq_valid && (uint8_t)(seq - snapshot->seq) == 0) {
+                    panel_stats.can_stale++;                // repeated commit
+                } else if (snapshot->seq_valid && (uint8_t)(seq - snapshot->seq) > 128) {
+                    panel_stats.can_stale++;                // older than the last snapshot
+                } else if ((snapshot->received & mask) != mask) {
+                    panel_stats.can_partial++;
+                } else {
+                    if (snapshot->seq_valid)
+                        panel_stats.can_missed += (uint8_t)(seq - snapshot->seq) - 1;
+                    snapshot->seq = seq;
+                    snapshot->seq_valid = true;
+                    commitCANbusSnapshot(mask);
+                }
+                snapshot->received = 0;
+            }
+            break;
+
+        case CANBUS_PANEL_ENCODER_1:
+            for (int i = 0; i < 4 && i < N_ENCODERS && i < message.len / 2; i++)
+                snapshot->encoder[i] = (message.data[i * 2] << 8) | message.data[i * 2 + 1];
+            snapshot->received |= PanelFrame_Encoder1;
+
+            if (!canbusSequenced())
+                commitCANbusSnapshot(PanelFrame_Encoder1);
+            break;
+
+        // latched key edges, up to 4 sequence number & key pairs
+        case CANBUS_PANEL_KEY_EVENTS:
+            processKeyEvents(message.data, min(message.len / 2, PANEL_KEY_EVENTS));
+            break;
+
+        // a (re)started panel, its cycle sequence starts over
+        case CANBUS_PANEL_CAPS:
+            setCapabilities(message.data);
+            snapshot->seq_valid = false;
+            snapshot->received = 0;
+            break;
+
+#if N_ENCODERS > 4
+        case CANBUS_PANEL_ENCODER_2:
+            for (int i = 4; i < N_ENCODERS && i - 4 < message.len / 2; i++)
+                snapshot->encoder[i] = (message.data[(i - 4) * 2] << 8) | message.data[(i - 4) * 2 + 1];
+            snapshot->received |= PanelFrame_Encoder2;
+
+            if (!canbusSequenced())
+                commitCANbusSnapshot(PanelFrame_Encoder2);
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    return(1);
+}
+
+// Position of the panel being serviced among the CAN panels, selects the id offset of its frames
+static uint_fast8_t canbusIndex (void)
+{
+    return transportPanel(&canbus_transport, 1) == panel ? 1 : 0;
+}
+
+// Frames from the second CAN panel use ids offset by PANEL_CANBUS_INSTANCE_OFFSET, or 1 for the realtime keys.
+// Frames for a CAN panel that is not configured are dropped.
+static bool panel_dequeue_rx (canbus_message_t message)
+{
+    panel_instance_t *current = panel;
+    uint_fast8_t index = 0;
+    bool ok = true;
+
+#if PANEL_INSTANCES > 1
+    if (message.id == CANBUS_PANEL_REALTIME + 1) {
+        index = 1;
+        message.id = CANBUS_PANEL_REALTIME;
+    } else if (message.id >= CANBUS_PANEL_BLAAH + PANEL_CANBUS_INSTANCE_OFFSET && message.id <= CANBUS_PANEL_KEY_EVENTS + PANEL_CANBUS_INSTANCE_OFFSET) {
+        index = 1;
+        message.id -= PANEL_CANBUS_INSTANCE_OFFSET;
+    }
+#endif
+
+    if ((panel = transportPanel(&canbus_transport, index)))
+        ok = processCANbusMessage(message);
+
+    panel = current;
+
+    return ok;
+}
+
+static void WriteCANbusState(panel_displaydata_t *displaydata)
+{
+    uint8_t format = displaydata->position_format | (panelVelocity() ? PANEL_POSITION_FORMAT_VELOCITY : 0);
+
+    memset(&tx_message, 0, sizeof(tx_message));
+    tx_message.id = CANBUS_PANEL_STATE_1;
+    tx_message.len = packCANbusFields(tx_message.data, CANBUS_PANEL_STATE_1, displaydata, format);
+    canbus_queue_tx(tx_message, false);
+
+    memset(&tx_message, 0, sizeof(tx_message));
+    tx_message.id = CANBUS_PANEL_STATE_2;
+    tx_message.len = packCANbusFields(tx_message.data, CANBUS_PANEL_STATE_2, displaydata, format);
+    canbus_queue_tx(tx_message, false);
+}
+
+// Medium & slow rate data
+static void WriteCANbusClasses(panel_displaydata_t *displaydata, uint8_t classes)
+{
+    if (classes & PanelRate_Medium) {
+        memset(&tx_message, 0, sizeof(tx_message));
+        tx_message.id = CANBUS_PANEL_STATE_3;
+        tx_message.len = packCANbusFields(tx_message.data, CANBUS_PANEL_STATE_3, displaydata, 0);
+        canbus_queue_tx(tx_message, false);
+    }
+
+    if (classes & PanelRate_Slow) {
+        memset(&tx_message, 0, sizeof(tx_message));
+        tx_message.id = CANBUS_PANEL_STATE_4;
+        tx_message.len = packCANbusFields(tx_message.data, CANBUS_PANEL_STATE_4, displaydata, 0);
+        canbus_queue_tx(tx_message, false);
+
+        memset(&tx_message, 0, sizeof(tx_message));
+        tx_message.id = CANBUS_PANEL_STATE_5;
+        tx_message.len = packCANbusFields(tx_message.data, CANBUS_PANEL_STATE_5, displaydata, 0);
+        canbus_queue_tx(tx_message, false);
+    }
+}
+
+// Bulk channel frames, broadcast to all panels. A few data frames per display update, resumed from the
+// first frame that could not be queued. BULK_START is sent ahead of the first data frame of a payload.
+static void WriteCANbusBulk(void)
+{
+    panel_bulk_progress_t *progress = &panel->bulk;
+
+    if (!bulkPending(progress))
+        return;
+
+    if (progress->offset == 0 && !progress->chunk) {
+        memset(&tx_message, 0, sizeof(tx_message));
+        tx_message.id = CANBUS_PANEL_BULK_START;
+        tx_message.len = 4;
+        tx_message.data[0] = bulk.id;
+        tx_message.data[1] = bulk.transfer;
+        tx_message.data[2] = bulk.length >> 8;
+        tx_message.data[3] = bulk.length & 0xFF;
+        if (!canbus_queue_tx(tx_message, false))
+            return;
+        progress->chunk = 1;            // start sent
+    }
+
+    for (uint_fast8_t frame = 0; frame < PANEL_CANBUS_BULK_FRAMES && progress->offset < bulk.length; frame++) {
+        memset(&tx_message, 0, sizeof(tx_message));
+        tx_message.id = CANBUS_PANEL_BULK_DATA;
+        tx_message.data[0] = bulk.transfer;
+        tx_message.data[1] = progress->offset >> 8;
+        tx_message.data[2] = progress->offset & 0xFF;
+        tx_message.len = 3;
+        while (tx_message.len < 8 && progress->offset + tx_message.len - 3 < bulk.length) {
+            tx_message.data[tx_message.len] = bulk.data[progress->offset + tx_message.len - 3];
+            tx_message.len++;
+        }
+        if (!canbus_queue_tx(tx_message, false)) {
+            panel_stats.bulk_resumed++;
+            break;
+        }
+        progress->offset += tx_message.len - 3;
+        panel_stats.bulk_chunks++;
+    }
+}
+
+// Ask for the panel capabilities, the panels also send them when they start up
+static void WriteCANbusCapabilitiesRequest(void)
+{
+    memset(&tx_message, 0, sizeof(tx_message));
+    tx_message.id = CANBUS_PANEL_CAPS_REQUEST + canbusIndex() * PANEL_CANBUS_INSTANCE_OFFSET;
+    tx_message.len = 0;
+    canbus_queue_tx(tx_message, false);
+}
+
+// Display frames are broadcast to all CAN panels, formatted for the capabilities of the panel being serviced, the first
+static void WriteCANbusOutputs(void)
+{
+    panel_displaydata_t *displaydata = &panel_displaydata;
+    panel_instance_t *current = panel;
+    uint8_t classes;
+
+    for (uint_fast8_t n = 0; (panel = transportPanel(&canbus_transport, n)); n++) {
+
+        panelProbe();
+
+        // the panel drops key events up to and including the acknowledged one
+        if (panel->key_events.ack_due) {
+            memset(&tx_message, 0, sizeof(tx_message));
+            tx_message.id = CANBUS_PANEL_KEY_EVENT_ACK + n * PANEL_CANBUS_INSTANCE_OFFSET;
+            tx_message.len = 1;
+            tx_message.data[0] = panel->key_events.seq;
+            if (canbus_queue_tx(tx_message, false))
+                panel->key_events.ack_due = false;
+        }
+    }
+
+    panel = current;
+    classes = displayClassesDue(hal.get_elapsed_ticks());
+
+    classes = processDisplayData(displaydata, classes);
+
+    // State
+    WriteCANbusState(displaydata);
+
+    // Machine position - up to 8 axis supported, 4 bytes per axis (or 2 bytes for delta frames)
+    uint16_t position[N_AXIS * 2];
+    uint_fast8_t n_position = packPositionWords(position, displaydata, N_AXIS * 2), idx = 0;
+    uint32_t id = (displaydata->position_frame & PANEL_POSITION_FRAME_DELTA) ? CANBUS_PANEL_MPOS_DELTA_1 : CANBUS_PANEL_MPOS_1;
+
+    while (idx < n_position) {
+        memset(&tx_message, 0, sizeof(tx_message));
+        tx_message.id = id++;
+        while (idx < n_position && tx_message.len < 8) {
+            tx_message.data[tx_message.len++] = (position[idx] >> 8) & 0xFF;
+            tx_message.data[tx_message.len++] = position[idx] & 0xFF;
+            idx++;
+        }
+        canbus_queue_tx(tx_message, false);
+    }
+
+    // Axis velocities - 2 bytes per axis
+    if (panelVelocity()) {
+        id = CANBUS_PANEL_VELOCITY_1;
+        idx = 0;
+        while (idx < panelAxes()) {
+            memset(&tx_message, 0, sizeof(tx_message));
+            tx_message.id = id++;
+            while (idx < panelAxes() && tx_message.len < 8) {
+                tx_message.data[tx_message.len++] = ((uint16_t)displaydata->velocity[idx] >> 8) & 0xFF;
+                tx_message.data[tx_message.len++] = (uint16_t)displaydata->velocity[idx] & 0xFF;
+                idx++;
+            }
+            canbus_queue_tx(tx_message, false);
+        }
+    }
+
+    // no application level acknowledgement on CAN
+    if (displaydata->position_format == PositionFormat_Delta && !(displaydata->position_frame & PANEL_POSITION_FRAME_DELTA))
+        positionKeyframeSent();
+
+    WriteCANbusClasses(displaydata, classes);
+
+    WriteCANbusBulk();
+}
+
+static void WriteCANbusEvent(void)
+{
+    processStateData(&panel_displaydata);
+    processOverrideData(&panel_displaydata);
+    WriteCANbusState(&panel_displaydata);
+}
+
+// CAN data is pushed to the callback, nothing to poll
+static void ReadCANbusInputs(void)
+{
+}
+
+static const panel_transport_t canbus_transport = {
+    .name = "CAN",
+    .polled = false,
+    .poll = ReadCANbusInputs,
+    .publish = WriteCANbusOutputs,
+    .event = WriteCANbusEvent,
+    .capabilities = WriteCANbusCapabilitiesRequest,
+    .link_ok = pushedLinkOk,
+    .input_period = pushedInputPeriod
+};
+
+void panel_canbus_config (void *data)
+{
+    if(canbus_enabled()) {
+        canbus_add_filter(0,  0, false, panel_dequeue_rx); // Single RX callback for all message id's
+    }
+}
+#endif // PANEL_CANBUS
+
+#if PANEL_UART
+
+// Modbus CRC16, so that panels can share the checksum code with their Modbus firmware
+static uint16_t uartCRC (const uint8_t *data, uint_fast16_t length)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (length--) {
+        crc ^= *data++;
+        for (uint_fast8_t bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+// Consistent overhead byte stuffing, the encoded frame has no zero bytes so that zero can delimit frames
+static uint_fast16_t cobsEncode (const uint8_t *data, uint_fast16_t length, uint8_t *frame)
+{
+    uint_fast16_t code_idx = 0, idx = 1;
+    uint8_t code = 1;
+
+    while (length--) {
+        if (*data) {
+            frame[idx++] = *data;
+            code++;
+        }
+        if (!*data++ || code == 0xFF) {
+            frame[code_idx] = code;
+            code_idx = idx++;
+            code = 1;
+        }
+    }
+
+    frame[code_idx] = code;
+
+    return idx;
+}
+
+// Decode in place, returns the decoded length or -1 if the frame is malformed
+static int_fast16_t cobsDecode (uint8_t *frame, uint_fast16_t length)
+{
+    uint_fast16_t idx = 0, decoded = 0;
+
+    while (idx < length) {
+        uint8_t code = frame[idx++];
+        if (code == 0 || idx + code - 1 > length)
+            return -1;
+        for (uint_fast8_t n = 1; n < code; n++)
+            frame[decoded++] = frame[idx++];
+        if (code < 0xFF && idx < length)
+            frame[decoded++] = 0;
+    }
+
+    return decoded;
+}
+
+// Send a packet of registers, returns false if the stream is not open
+static bool WriteUartPacket (panel_uart_packet_t type, uint16_t start_reg, const uint16_t *registers, uint_fast8_t n_registers)
+{
+    uint8_t packet[PANEL_UART_PACKET_SIZE], frame[PANEL_UART_FRAME_SIZE];
+    uint_fast16_t length = 0;
+    uint16_t crc;
+
+    if (!uart.open)
+        return false;
+
+    n_registers = min(n_registers, PANEL_UART_MAX_REGS);
+
+    packet[length++] = type;
+    packet[length++] = uart.tx_seq++;
+    packet[length++] = start_reg >> 8;
+    packet[length++] = start_reg & 0xFF;
+    for (uint_fast8_t idx = 0; idx < n_registers; idx++) {
+        packet[length++] = registers[idx] >> 8;
+        packet[length++] = registers[idx] & 0xFF;
+    }
+    crc = uartCRC(packet, length);
+    packet[length++] = crc & 0xFF;
+    packet[length++] = crc >> 8;
+
+    length = cobsEncode(packet, length, frame);
+    frame[length++] = 0;
+
+    uart.stream.write_n(frame, length);
+    panel_stats.uart_tx++;
+
+    return true;
+}
+
+static void WriteUartCapabilitiesRequest(void)
+{
+    uint16_t registers[1] = { PANEL_MODBUS_CAPS_COUNT };
+
+    WriteUartPacket(PanelUart_ReadRegisters, PANEL_MODBUS_CAPS_REG, registers, 1);
+}
+
+// Input registers from the panel, the capability block or the inputs from register 100
+static void processUartPacket (uint8_t *packet, uint_fast16_t length)
+{
+    uint_fast8_t n_registers = (length - 4) / 2;
+    uint16_t start_reg = (packet[2] << 8) | packet[3];
+
+    if (packet[0] != PanelUart_InputRegisters || (length & 1))
+        return;
+
+    // panels number their packets, the controller processes the latest
+    if (uart.rx_seq_valid && packet[1] == uart.rx_seq) {
+        panel_stats.uart_duplicates++;
+        return;
+    }
+
+    if (uart.rx_seq_valid && packet[1] != (uint8_t)(uart.rx_seq + 1))
+        panel_stats.uart_lost += (uint8_t)(packet[1] - uart.rx_seq - 1);
+    uart.rx_seq = packet[1];
+    uart.rx_seq_valid = true;
+
+    if (start_reg == PANEL_MODBUS_CAPS_REG && n_registers >= PANEL_MODBUS_CAPS_COUNT)
+        setCapabilityRegisters(&packet[4]);
+
+    else if (start_reg == PANEL_MODBUS_START_REG && n_registers >= PANEL_MODBUS_READREG_COUNT) {
+        n_registers = min(n_registers, PANEL_MODBUS_INPUT_REGS);
+        memset(panel->input_registers, 0, sizeof(panel->input_registers));
+        for (uint_fast8_t idx = 0; idx < n_registers; idx++)
+            panel->input_registers[idx] = (packet[4 + idx * 2] << 8) | packet[5 + idx * 2];
+        // Registers 100-101 - panel ticks, one way as for CAN so the delay is unknown
+        clockSample(((uint32_t)panel->input_registers[0] << 16) | panel->input_registers[1], hal.get_elapsed_ticks(), 0);
+        processInputRegisters();
+    }
+}
+
+// Drain the receive buffer, frames are decoded as their delimiter arrives
+static void ReadUartInputs(void)
+{
+    panel_instance_t *current = panel;
+    int32_t c;
+
+    if (!uart.open)
+        return;
+
+    while ((c = uart.stream.read()) != SERIAL_NO_DATA) {
+        if (c) {
+            if (uart.rx_length < sizeof(uart.rx_buffer))
+                uart.rx_buffer[uart.rx_length++] = c;
+            else if (!uart.rx_overrun) {
+                uart.rx_overrun = true;
+                panel_stats.uart_overruns++;
+            }
+            continue;
+        }
+
+        if (uart.rx_length && !uart.rx_overrun) {
+            int_fast16_t length = cobsDecode(uart.rx_buffer, uart.rx_length);
+
+            if (length < 6 || uartCRC(uart.rx_buffer, length - 2) != (uart.rx_buffer[length - 2] | (uart.rx_buffer[length - 1] << 8)))
+                panel_stats.uart_errors++;
+            else {
+                panel_stats.uart_rx++;
+                if ((panel = transportPanel(&uart_transport, 0)))
+                    processUartPacket(uart.rx_buffer, length - 2);
+                panel = current;
+            }
+        }
+
+        uart.rx_length = 0;
+        uart.rx_overrun = false;
+    }
+}
+
+// Display data pushed to the panel, the same register windows as for Modbus, but written as a whole and
+// without waiting for replies. Skipped while the stream is still busy sending earlier packets.
+static void WriteUartOutputs(void)
+{
+    panel_displaydata_t *displaydata = &panel_displaydata;
+    uint16_t registers[PANEL_UART_MAX_REGS];
+    uint_fast8_t n_position;
+    uint8_t format, classes;
+
+    if (!uart.open)
+        return;
+
+    if (uart.stream.get_tx_buffer_count && uart.stream.get_tx_buffer_count() > PANEL_UART_TX_BACKLOG) {
+        panel_stats.uart_skipped++;
+        return;
+    }
+
+    panelProbe();
+
+    // the panel drops key events up to and including the acknowledged one
+    if (panel->key_events.ack_due) {
+        registers[0] = panel->key_events.seq;
+        if (WriteUartPacket(PanelUart_WriteRegisters, PANEL_MODBUS_EVENT_ACK_REG, registers, 1))
+            panel->key_events.ack_due = false;
+    }
+
+    classes = displayClassesDue(hal.get_elapsed_ticks());
+    classes = processDisplayData(displaydata, classes);
+
+    // Registers 100 onwards - state, then axis positions in the selected format, optionally followed by sample time & velocities
+    n_position = packPositionWords(&registers[7], displaydata, N_AXIS * 2);
+    format = displaydata->position_format;
+
+    if (panelVelocity()) {
+        uint_fast8_t n_axis = (displaydata->position_frame & PANEL_POSITION_FRAME_DELTA) ? n_position : n_position / 2;
+        registers[7 + n_position++] = displaydata->sample_ms;
+        for (uint_fast8_t idx = 0; idx < n_axis; idx++)
+            registers[7 + n_position++] = (uint16_t)displaydata->velocity[idx];
+        format |= PANEL_POSITION_FORMAT_VELOCITY;
+    }
+
+    packStateRegisters(registers, displaydata, format);
+    uart.format = format;
+
+    WriteUartPacket(PanelUart_WriteRegisters, PANEL_MODBUS_START_REG, registers, 7 + n_position);
+
+    // no acknowledgement, the stream delivers packets in order and the panel drops corrupted ones
+    if (displaydata->position_format == PositionFormat_Delta && !(displaydata->position_frame & PANEL_POSITION_FRAME_DELTA))
+        positionKeyframeSent();
+
+    if (classes & PanelRate_Medium) {
+        packMediumRegisters(registers, displaydata);
+        WriteUartPacket(PanelUart_WriteRegisters, PANEL_MODBUS_MEDIUM_REG, registers, PANEL_MODBUS_MEDIUM_COUNT);
+    }
+
+    if (classes & PanelRate_Slow) {
+        packSlowRegisters(registers, displaydata);
+        WriteUartPacket(PanelUart_WriteRegisters, PANEL_MODBUS_SLOW_REG, registers, PANEL_MODBUS_SLOW_COUNT);
+    }
+
+    // Bulk channel, one chunk per update
+    if (bulkPending(&panel->bulk)) {
+        uint_fast16_t n_bytes = min(bulk.length - panel->bulk.offset, (PANEL_UART_MAX_REGS - PANEL_MODBUS_BULK_HEADER) * 2);
+        packBulkRegisters(registers, panel->bulk.offset, n_bytes);
+        if (WriteUartPacket(PanelUart_WriteRegisters, PANEL_MODBUS_BULK_REG, registers, PANEL_MODBUS_BULK_HEADER + (n_bytes + 1) / 2)) {
+            panel->bulk.offset += n_bytes;
+            panel_stats.bulk_chunks++;
+        }
+    }
+}
+
+// State registers only, with the position format & frame of the last display packet
+static void WriteUartEvent(void)
+{
+    uint16_t registers[7];
+
+    processStateData(&panel_displaydata);
+    processOverrideData(&panel_displaydata);
+    packStateRegisters(registers, &panel_displaydata, uart.format);
+
+    WriteUartPacket(PanelUart_WriteRegisters, PANEL_MODBUS_START_REG, registers, 7);
+}
+
+static const panel_transport_t uart_transport = {
+    .name = "UART",
+    .polled = false,
+    .poll = ReadUartInputs,
+    .publish = WriteUartOutputs,
+    .event = WriteUartEvent,
+    .capabilities = WriteUartCapabilitiesRequest,
+    .link_ok = pushedLinkOk,
+    .input_period = pushedInputPeriod
+};
+#endif // PANEL_UART
+
+// Coherent copy of sys.position, which the stepper interrupt may be updating while we read it. The copy is
+// repeated until two consecutive reads agree, at which point no axis changed between the reads, so the values
+// were all valid together at the instant between them. Falls back to briefly masking interrupts for the copy
+// only, if the position keeps changing underneath us.
+static inline void copyPosition(int32_t *position)
+{
+    volatile int32_t *source = sys.position;    // force every read to be made, and in order
+
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+        position[idx] = source[idx];
+}
+
+static void getPositionSnapshot(int32_t *position)
+{
+    int32_t check[N_AXIS];
+    uint_fast8_t retries = PANEL_POSITION_SNAPSHOT_RETRIES;
+
+    copyPosition(position);
+
+    do {
+        copyPosition(check);
+        if (!memcmp(check, position, sizeof(check)))
+            return;
+        memcpy(position, check, sizeof(check));
+    } while (--retries);
+
+    hal.irq_disable();
+    copyPosition(position);
+    hal.irq_enable();
+
+    panel_stats.position_snapshot_locked++;
+}
+
+static void positionKeyframeReference(void)
+{
+    memcpy(panel->position_delta.reference, panel->position_delta.pending, sizeof(panel->position_delta.reference));
+    panel->position_delta.reference_id = panel->position_delta.pending_id;
+    panel->position_delta.reference_ok = true;
+    panel->position_delta.keyframe_due = false;
+}
+
+#if PANEL_MODBUS
+// Only the last keyframe sent becomes the reference, an acknowledgement for an earlier one is ignored
+static void positionKeyframeAcknowledged(uint8_t id)
+{
+    if (panel->position_delta.keyframe_due && id == panel->position_delta.pending_id)
+        positionKeyframeReference();
+}
+#endif
+
+#if PANEL_CANBUS || PANEL_UART
+// Without an acknowledgement the keyframe is taken as the reference once sent. Deltas carry its id, so a panel
+// that missed it drops them until the next keyframe, sent every PANEL_POSITION_KEYFRAME_UNACKED updates.
+static void positionKeyframeSent(void)
+{
+    positionKeyframeReference();
+    panel->position_delta.frames = PANEL_POSITION_KEYFRAME_INTERVAL - min(PANEL_POSITION_KEYFRAME_UNACKED, PANEL_POSITION_KEYFRAME_INTERVAL);
+}
+#endif
+
+// Convert positions to the configured compact format. In delta format, an absolute keyframe is sent
+// until one has been acknowledged, every PANEL_POSITION_KEYFRAME_INTERVAL frames, and whenever an
+// increment would not fit in 16 bits.
+static void encodePositions(panel_displaydata_t *displaydata)
+{
+    float scale = panelPositionFormat() == PositionFormat_SubMicron ? 10000.0f : 1000.0f;
+    int32_t delta[N_AXIS];
+    bool keyframe;
+
+    displaydata->position_format = panelPositionFormat();
+    displaydata->position_frame = 0;
+
+    if (displaydata->position_format == PositionFormat_Float)
+        return;
+
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+        displaydata->position_fixed[idx] = lroundf(displaydata->position[idx].value * scale);
+
+    if (displaydata->position_format != PositionFormat_Delta)
+        return;
+
+    keyframe = !panel->position_delta.reference_ok || panel->position_delta.keyframe_due || ++panel->position_delta.frames >= PANEL_POSITION_KEYFRAME_INTERVAL;
+
+    for (uint_fast8_t idx = 0; idx < N_AXIS && !keyframe; idx++) {
+        delta[idx] = displaydata->position_fixed[idx] - panel->position_delta.reference[idx];
+        keyframe = delta[idx] > INT16_MAX || delta[idx] < INT16_MIN;
+    }
+
+    if (keyframe) {
+        panel->position_delta.pending_id = (panel->position_delta.pending_id + 1) & ~PANEL_POSITION_FRAME_DELTA;
+        memcpy(panel->position_delta.pending, displaydata->position_fixed, sizeof(panel->position_delta.pending));
+        panel->position_delta.keyframe_due = true;
+        panel->position_delta.frames = 0;
+        displaydata->position_frame = panel->position_delta.pending_id;
+    } else {
+        memcpy(displaydata->position_fixed, delta, sizeof(delta));
+        displaydata->position_frame = PANEL_POSITION_FRAME_DELTA | panel->position_delta.reference_id;
+    }
+}
+
+// Axis velocities for panel side interpolation between updates, in 0.1 mm/s (or 0.1 deg/s). The magnitude is
+// the current realtime feed rate, the direction is taken from the machine motion since the panel's previous sample.
+static void computeVelocity(panel_displaydata_t *displaydata, float *machine_position)
+{
+    float *last_position = panel->velocity_position;
+    float delta[N_AXIS], length = 0.0f, rate = st_get_realtime_rate();
+
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        delta[idx] = machine_position[idx] - last_position[idx];
+        last_position[idx] = machine_position[idx];
+        length += delta[idx] * delta[idx];
+    }
+
+    length = sqrtf(length);
+
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        float velocity = (length > 0.0f && rate > 0.0f) ? (rate / 6.0f) * (delta[idx] / length) : 0.0f;   // mm/min to 0.1 mm/s
+        displaydata->velocity[idx] = (int16_t)lroundf(max(min(velocity, (float)INT16_MAX), (float)INT16_MIN));
+    }
+}
+
+// Display data classes due this update. Slow rate data is also sent early if it has changed.
+static uint8_t displayClassesDue(uint32_t ms)
+{
+    uint8_t classes = PanelRate_Fast;
+
+    if (!panel->classes_started || ms - panel->medium_ms >= panel_settings.medium_interval) {
+        panel->medium_ms = ms;
+        classes |= PanelRate_Medium;
+    }
+
+    if (!panel->classes_started || panel->slow_due || ms - panel->slow_ms >= panel_settings.slow_interval) {
+        panel->slow_ms = ms;
+        panel->slow_due = false;
+        classes |= PanelRate_Slow;
+    }
+
+    panel->classes_started = true;
+
+    return classes;
+}
+
+// Slow rate data has changed, send it to all panels with their next update
+static void setSlowDue (void)
+{
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++)
+        panels[idx].slow_due = true;
+}
+
+// State and modes, cheap to retrieve, sent with every update
+static void processStateData(panel_displaydata_t *displaydata)
+{
+    displaydata->grbl_state = grbl_state;
+
+    displaydata->mpg_mode = mpg_axis;
+    displaydata->jog_mode = jog_mode;
+}
+
+// Overrides, also sent out of cycle on changes
+static void processOverrideData(panel_displaydata_t *displaydata)
+{
+    displaydata->feed_override    = sys.override.feed_rate;
+    displaydata->rapid_override   = sys.override.rapid_rate;
+    displaydata->spindle_override = spindle_get(0)->param->override_pct;
+}
+
+// Returns the rate classes to send, medium & slow rate windows that are due but unchanged are dropped
+static uint8_t processDisplayData(panel_displaydata_t *displaydata, uint8_t classes)
+{
+    panel_rate_sent_t *sent = &panel->rate_sent;
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    // Spindle data, overrides & WCS are carried in the state registers and frames, so sampled with every update.
+    // Spindle data is read from the cache only, retrieving it may generate bus traffic
+    displaydata->spindle_speed = spindle_cache[0].speed;
+    displaydata->spindle_load = spindle_cache[0].load;
+    displaydata->wcs = gc_state.modal.coord_system.id;
+
+    processOverrideData(displaydata);
+
+    if (ms - sent->refresh_ms >= PANEL_RATE_REFRESH_INTERVAL) {
+        sent->refresh_ms = ms;
+        sent->medium_valid = sent->slow_valid = false;
+    }
+
+    if (classes & PanelRate_Medium) {
+        displaydata->feed_rate.value = st_get_realtime_rate();
+
+        plan_block_t *block = plan_get_current_block();
+        displaydata->line_number = block ? block->line_number : 0;
+
+        if (sent->medium_valid && sent->feed_rate == displaydata->feed_rate.value && sent->line_number == displaydata->line_number)
+            classes &= ~PanelRate_Medium;
+        else {
+            sent->feed_rate = displaydata->feed_rate.value;
+            sent->line_number = displaydata->line_number;
+            sent->medium_valid = true;
+        }
+    }
+
+    if (classes & PanelRate_Slow) {
+        displaydata->tool = gc_state.tool ? gc_state.tool->tool_id : 0;
+        displaydata->alarm = grbl_state == STATE_ALARM ? sys.alarm : 0;
+        displaydata->firmware_build = GRBL_BUILD;
+
+        if (sent->slow_valid && sent->tool == displaydata->tool && sent->alarm == displaydata->alarm && sent->wcs == displaydata->wcs)
+            classes &= ~PanelRate_Slow;
+        else {
+            sent->tool = displaydata->tool;
+            sent->alarm = displaydata->alarm;
+            sent->wcs = displaydata->wcs;
+            sent->slow_valid = true;
+        }
+    }
+
+    processStateData(displaydata);
+
+    int32_t raw_position[N_AXIS];
+    float   machine_position[N_AXIS];
+
+    getPositionSnapshot(raw_position);
+    displaydata->sample_ms = hal.get_elapsed_ticks() & 0xFFFF;
+    system_convert_array_steps_to_mpos(machine_position, raw_position);
+
+    computeVelocity(displaydata, machine_position);
+
+    // Work coordinate offsets only change on the events hooked below, so are cached rather than
+    // retrieved on each pass. Also check the coordinate system in case a change was missed.
+    if (!wco_valid || wco_coord_system != gc_state.modal.coord_system.id) {
+        for (uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+            wco[idx] = gc_get_offset(idx, false);
+        wco_coord_system = gc_state.modal.coord_system.id;
+        wco_valid = true;
+    }
+
+    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+        // Apply work coordinate offsets and tool length offset to current position.
+        displaydata->position[idx].value = machine_position[idx] - wco[idx];
+    }
+
+    encodePositions(displaydata);
+
+    return classes;
+}
+
+// Pack the encoded axis positions into 16 bit words for transmission, returns the number of words used.
+// 32 bit values are sent low word first, to match the existing float layout.
+static uint_fast8_t packPositionWords(uint16_t *words, panel_displaydata_t *displaydata, uint_fast8_t max_words)
+{
+    uint_fast8_t n_words = 0;
+
+    for (uint_fast8_t idx = 0; idx < panelAxes(); idx++) {
+        if (displaydata->position_frame & PANEL_POSITION_FRAME_DELTA) {
+            if (n_words + 1 > max_words)
+                break;
+            words[n_words++] = (uint16_t)displaydata->position_fixed[idx];
+        } else {
+            if (n_words + 2 > max_words)
+                break;
+            if (displaydata->position_format == PositionFormat_Float) {
+                words[n_words++] = (displaydata->position[idx].bytes[1] << 8) | displaydata->position[idx].bytes[0];
+                words[n_words++] = (displaydata->position[idx].bytes[3] << 8) | displaydata->position[idx].bytes[2];
+            } else {
+                words[n_words++] = (uint32_t)displaydata->position_fixed[idx] & 0xFFFF;
+                words[n_words++] = (uint32_t)displaydata->position_fixed[idx] >> 16;
+            }
+        }
+    }
+
+    return n_words;
+}
+
+// Invalidate the cached work coordinate offsets on any change to coordinate system, offsets or tool data
+static void onWcoChanged (void)
+{
+    wco_valid = false;
+    setSlowDue();
+
+    if (on_wco_changed)
+        on_wco_changed();
+}
+
+static void onToolChanged (tool_data_t *tool)
+{
+    wco_valid = false;
+    setSlowDue();
+
+    if (on_tool_changed)
+        on_tool_changed(tool);
+}
+
+// Push state, alarm & E-stop changes to the panel without waiting for the next regular update
+static void onStateChange (sys_state_t state)
+{
+    grbl_state = state;
+    display_event = true;
+
+    if (state == STATE_ALARM)
+        setSlowDue();   // alarm code
+
+    // press to motion latency, for the last jog, cycle start or feed hold press on each panel
+    if (state & (STATE_CYCLE | STATE_JOG | STATE_HOLD)) {
+        uint32_t ms = hal.get_elapsed_ticks();
+        for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++) {
+            panel_clock_t *clock = &panels[idx].clock;
+            if (clock->motion_trace && ms - clock->press_ms <= PANEL_LATENCY_MOTION_TIMEOUT)
+                latencyRecord(panel_stats.latency_motion, &panel_stats.latency_motion_max, ms - clock->press_ms);
+            clock->motion_trace = false;
+        }
+    }
+
+    if (on_state_change)
+        on_state_change(state);
+}
+
+static void onOverrideChanged (override_changed_t changed)
+{
+    display_event = true;
+
+    if (on_override_changed)
+        on_override_changed(changed);
+}
+
+// Program messages, (MSG, ...), are sent to the panel on the bulk channel
+static void onGcodeMessage (char *message)
+{
+    panel_bulk_send(PanelBulk_Message, (uint8_t *)message, min(strlen(message), PANEL_BULK_SIZE));
+
+    if (on_gcode_message)
+        on_gcode_message(message);
+}
+
+static void onReset (void)
+{
+    wco_valid = false;
+
+    if (on_reset)
+        on_reset();
+}
+
+// Expected time between panel input samples (ms)
+static uint32_t panel_input_period (void)
+{
+    return panel->transport->input_period();
+}
+
+static void pollActivity (void)
+{
+    poll_activity_ms = hal.get_elapsed_ticks();
+}
+
+// Faster updates while encoders, keys or the machine are moving, slower once quiet for the idle timeout,
+// and slower again while the bus is saturated, see busCycle()
+static void pollUpdate (uint32_t ms)
+{
+    uint16_t interval = panel_settings.update_interval;
+
+    if (grbl_state & (STATE_CYCLE | STATE_JOG | STATE_HOMING))
+        poll_activity_ms = ms;
 
-#if N_AXIS > 6
-    memset(&tx_message, 0, sizeof(tx_message));
-    tx_message.id = CANBUS_PANEL_MPOS_5;
-    tx_message.len = 4;
-    tx_message.data[0] = (displaydata.position[6].bytes[1]);
-    tx_message.data[1] = (displaydata.position[6].bytes[0]);
-    tx_message.data[2] = (displaydata.position[6].bytes[3]);
-    tx_message.data[3] = (displaydata.position[6].bytes[2]);
-#if N_AXIS > 7
-    tx_message.len = 8;
-    tx_message.data[4] = (displaydata.position[7].bytes[1]);
-    tx_message.data[5] = (displaydata.position[7].bytes[0]);
-    tx_message.data[6] = (displaydata.position[7].bytes[3]);
-    tx_message.data[7] = (displaydata.position[7].bytes[2]);
-#endif
-    canbus_queue_tx(tx_message, false);
-#endif
+    if (panel_settings.active_interval && ms - poll_activity_ms < PANEL_POLL_ACTIVE_HOLD)
+        interval = min(panel_settings.active_interval, interval);
+    else if (panel_settings.idle_timeout && ms - poll_activity_ms >= panel_settings.idle_timeout * 1000UL)
+        interval = max(panel_settings.idle_interval, interval);
+
+    poll_base_interval = interval;
+    poll_interval = interval * poll_backoff;
+
+    panel_stats.poll_backoff = poll_backoff;
+    panel_stats.poll_backoff_max = max(panel_stats.poll_backoff_max, poll_backoff);
 }
 
-void panel_canbus_config (void *data)
+// Distance covered by the keypad jog velocity profile after elapsed_ms, accelerating at the configured
+// axis acceleration up to the lower of the keypad jog speed and the axis max rate. Also returns the
+// profile velocity at that time, in mm/min.
+static float keypadJogProfile (uint_fast8_t idx, uint32_t elapsed_ms, float *rate)
 {
-    if(canbus_enabled()) {
-        canbus_add_filter(0,  0, false, panel_dequeue_rx); // Single RX callback for all message id's
+    float t = elapsed_ms / 60000.0f;                        // minutes, to match grbl units
+    float accel = settings.axis[idx].acceleration;          // mm/min^2
+    float max_rate = min((float)panel_settings.jog_speed_keypad, settings.axis[idx].max_rate);
+    float t_accel = max_rate / accel;
+
+    if (t < t_accel) {
+        *rate = accel * t;
+        return 0.5f * accel * t * t;
     }
+
+    *rate = max_rate;
+    return max_rate * (t - 0.5f * t_accel);
 }
-#endif // PANEL_ENABLE == 2
 
-static void processDisplayData(panel_displaydata_t *displaydata)
+// Stop, feed hold, cycle start & reset - can be processed in any state. These may also be delivered through
+// a dedicated fast path (short Modbus poll, or priority CAN frame), so act on rising edges only, to avoid
+// executing a press again when the same key is seen in the full keypad data.
+static void processRealtimeKeys(uint16_t value)
 {
     static uint32_t last_ms;
     uint32_t ms = hal.get_elapsed_ticks();
+    panel_keydata_1_t pressed;
 
-    // Don't spam the spindle, retrieving the spindle state may generate multiple new modbus requests
-    // (for instance Huanyang v1 uses seperate requests for RPM and Amps), which can saturate the
-    // Modbus RX buffer if spindle is offline...
-    //
-    // todo: can we set this a bit more intelligently, based on a multiple of the modbus rx timeout?
-    if (ms - last_ms > 250) {
-        last_ms = ms;
-
-        spindle_ptrs_t *spindle_0;
-        spindle_state_t spindle_0_state;
+    pressed.value = value & ~panel->realtime_keys;
+    panel->realtime_keys = value;
 
-        spindle_0 = spindle_get(0);
-        spindle_0_state = spindle_0->get_state(spindle_0);
-
-        if(!spindle_0->get_data) {
-            displaydata->spindle_speed = lroundf(spindle_0_state.on ? spindle_0->param->rpm_overridden : 0);
-        } else {
-            displaydata->spindle_speed = lroundf(spindle_0->get_data(SpindleData_RPM)->rpm);
-        }
+    if (panel_stats.realtime_samples++ && ms - last_ms > panel_stats.realtime_interval_max)
+        panel_stats.realtime_interval_max = ms - last_ms;
+    last_ms = ms;
 
-#if VFD_ENABLE
-        const vfd_ptrs_t *vfd_spindle = vfd_get_active();
-        if (vfd_spindle && vfd_spindle->get_load) {
-            displaydata->spindle_load = lroundf(vfd_spindle->get_load());
-        }
-#endif
+    if (pressed.value & PANEL_LATENCY_REALTIME_KEYS)
+        latencyPress(pressed.value & PANEL_LATENCY_MOTION_KEYS_1);
 
-        displaydata->spindle_override = spindle_0->param->override_pct;
-    }
+    if (pressed.stop)
+        grbl.enqueue_realtime_command(CMD_STOP);
 
-    displaydata->grbl_state = grbl_state;
+    if (pressed.feed_hold)
+        grbl.enqueue_realtime_command(CMD_FEED_HOLD);
 
-    displaydata->wcs = gc_state.modal.coord_system.id;
+    if (pressed.cycle_start)
+        grbl.enqueue_realtime_command(CMD_CYCLE_START);
 
-    displaydata->mpg_mode = mpg_axis;
-    displaydata->jog_mode = jog_mode;
+    if (pressed.reset)
+        grbl.enqueue_realtime_command(CMD_RESET);
+}
 
-    displaydata->feed_override    = sys.override.feed_rate;
-    displaydata->rapid_override   = sys.override.rapid_rate;
+#if PANEL_INSTANCES > 1
+static uint8_t jogPriority (uint_fast8_t index)
+{
+    return panel_settings.jog_priority[index];
+}
+#endif
 
-    int32_t raw_position[N_AXIS];
-    float   machine_position[N_AXIS];
+// Only one panel may jog at a time. A panel with a higher jog priority takes over from the owner, cancelling its jog,
+// with equal priority the owner keeps control until it stops jogging. Returns true if the current panel may jog now.
+static bool jogClaim (void)
+{
+    if (jog_owner >= 0 && jog_owner != panel->index) {
+#if PANEL_INSTANCES > 1
+        if (jogPriority(panel->index) > jogPriority(jog_owner)) {
+            grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
+            panels[jog_owner].keypad_jog.in_progress = false;
+            jog_owner = panel->index;
+            jog_owner_ms = hal.get_elapsed_ticks();
+        }
+#endif
+        // jog starts with the next input, after the cancel has flushed the planner
+        panel_stats.jog_conflicts++;
+        return false;
+    }
 
-    memcpy(raw_position, sys.position, sizeof(sys.position));
-    system_convert_array_steps_to_mpos(machine_position, raw_position);
+    jog_owner = panel->index;
+    jog_owner_ms = hal.get_elapsed_ticks();
 
-    float wco[N_AXIS];
-    for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
-        // Apply work coordinate offsets and tool length offset to current position.
-        wco[idx] = gc_get_offset(idx, false);
-        displaydata->position[idx].value = machine_position[idx] - wco[idx];
-    }
+    return true;
 }
 
 static void processKeypad(uint16_t keydata[])
 {
-    static uint16_t last_keydata_1, last_keydata_2, last_keydata_3, last_keydata_4, last_keydata_5;
+    uint16_t *last_keydata = panel->last_keydata;
     char command[30] = "";
     bool jogRequested = false;
-    static bool jogInProgress;
-    static uint8_t jogRampCount;
+    bool jogSend = true;
+    uint_fast8_t jogAxis = 0;
+    float jogDistance = 0.0f;
     uint8_t keypad_jog_mode = jog_mode_smooth;
 
     panel_keydata_1_t keydata_1;
@@ -628,6 +2783,16 @@ static void processKeypad(uint16_t keydata[])
     panel_keydata_4_t keydata_4;
     panel_keydata_5_t keydata_5;
 
+    latencyKeyPress(keydata);
+
+    // key changes and held jog keys keep the panel at the active update interval
+    for (uint_fast8_t idx = 0; idx < 4; idx++) {
+        if (keydata[idx] != last_keydata[idx])
+            pollActivity();
+    }
+    if (panel->keypad_jog.in_progress)
+        pollActivity();
+
     keydata_1.value = keydata[0];
     keydata_2.value = keydata[1];
     keydata_3.value = keydata[2];
@@ -635,31 +2800,19 @@ static void processKeypad(uint16_t keydata[])
     keydata_5.value = keydata[4];
 
     UNUSED(keydata_5);
-    UNUSED(last_keydata_5);
 
     //
     // keydata_1
     // - key repeats not required
-    // - cycle start/feed hold/stop/reset can be executed in any state
+    // - cycle start/feed hold/stop/reset can be executed in any state, see processRealtimeKeys()
     // - unlock only in locked state
     // - home in idle or alarm state
     // - spindle control only in idle state
     // - single block toggle in idle/hold?
     //
-    if (keydata_1.value != last_keydata_1) {
-
-        // realtime commands - can be processed in any state
-        if (keydata_1.stop)
-            grbl.enqueue_realtime_command(CMD_STOP);
-
-        if (keydata_1.feed_hold)
-            grbl.enqueue_realtime_command(CMD_FEED_HOLD);
-
-        if (keydata_1.cycle_start)
-            grbl.enqueue_realtime_command(CMD_CYCLE_START);
+    processRealtimeKeys(keydata_1.value);
 
-        if (keydata_1.reset)
-            grbl.enqueue_realtime_command(CMD_RESET);
+    if (keydata_1.value != last_keydata[0]) {
 
         // change active mpg axis - can be processed in any state
         if (keydata_1.mpg_axis_x)
@@ -715,14 +2868,14 @@ static void processKeypad(uint16_t keydata[])
         }
 
     }
-    last_keydata_1 = keydata_1.value;
+    last_keydata[0] = keydata_1.value;
 
     //
     // keydata_2
     // - key repeats not required
     // - set wcs, zero work offsets, move to zero - only from idle state
     //
-    if (keydata_2.value != last_keydata_2) {
+    if (keydata_2.value != last_keydata[1]) {
 
         if (grbl_state == STATE_IDLE) {
 
@@ -771,7 +2924,7 @@ static void processKeypad(uint16_t keydata[])
         }
 
     }
-    last_keydata_2 = keydata_2.value;
+    last_keydata[1] = keydata_2.value;
 
     //
     // keydata_3
@@ -780,7 +2933,7 @@ static void processKeypad(uint16_t keydata[])
     //
 
     // update mpg jog mode from any state
-    if (keydata_3.value != last_keydata_3) {
+    if (keydata_3.value != last_keydata[2]) {
         if (keydata_3.jog_step_x1)
             jog_mode = jog_mode_x1;
         if (keydata_3.jog_step_x10)
@@ -800,37 +2953,51 @@ static void processKeypad(uint16_t keydata[])
     {
         if (keydata_3.jog_positive_x) {
             strcpy(command, "$J=G91X");
+            jogAxis = 0;
             jogRequested = true;
         } else if (keydata_3.jog_negative_x) {
             strcpy(command, "$J=G91X-");
+            jogAxis = 0;
             jogRequested = true;
         } else if (keydata_3.jog_positive_y) {
             strcpy(command, "$J=G91Y");
+            jogAxis = 1;
             jogRequested = true;
         } else if (keydata_3.jog_negative_y) {
             strcpy(command, "$J=G91Y-");
+            jogAxis = 1;
             jogRequested = true;
         } else if (keydata_3.jog_positive_z) {
             strcpy(command, "$J=G91Z");
+            jogAxis = 2;
             jogRequested = true;
         } else if (keydata_3.jog_negative_z) {
             strcpy(command, "$J=G91Z-");
+            jogAxis = 2;
             jogRequested = true;
         } else if (keydata_3.jog_positive_a) {
             strcpy(command, "$J=G91A");
+            jogAxis = 3;
             jogRequested = true;
         } else if (keydata_3.jog_negative_a) {
             strcpy(command, "$J=G91A-");
+            jogAxis = 3;
             jogRequested = true;
         } else if (keydata_3.jog_positive_b) {
             strcpy(command, "$J=G91B");
+            jogAxis = 4;
             jogRequested = true;
         } else if (keydata_3.jog_negative_b) {
             strcpy(command, "$J=G91B-");
+            jogAxis = 4;
             jogRequested = true;
         }
 
-        if (jogRequested && !plan_check_full_buffer())
+        // ignore keys for axes that are not configured
+        if (jogAxis >= N_AXIS)
+            jogRequested = false;
+
+        if (jogRequested && !plan_check_full_buffer() && jogClaim())
         {
             // note: keypad jogging is currently always in smooth mode..
             switch (keypad_jog_mode) {
@@ -854,17 +3021,31 @@ static void processKeypad(uint16_t keydata[])
                     break;
 
                 case (jog_mode_smooth):
-                    // Initial attempt at acceleration ramp for smooth keypad jogging..
-                    if (!jogInProgress)
-                        jogRampCount = panel_settings.jog_accel_ramp;
-                    else if (jogRampCount)
-                        jogRampCount--;
-
-                    float jogAccel = (panel_settings.jog_accel_ramp - jogRampCount) / (float)panel_settings.jog_accel_ramp;
-
-                    strcat(command, ftoa(panel_settings.jog_distance_keypad * jogAccel, 3));
-                    strcat(command, "F");
-                    strcat(command, ftoa(panel_settings.jog_speed_keypad * jogAccel, 0));
+                    // Time based acceleration profile for smooth keypad jogging. Each repeat requests the distance the
+                    // profile covers up to the next expected input, plus a margin, less what has already been planned.
+                    // This keeps the planner fed without overfilling it, and bounds the overrun after key release.
+                    {
+                        uint32_t ms = hal.get_elapsed_ticks();
+                        float jogRate, jogTarget;
+
+                        if (!panel->keypad_jog.in_progress) {
+                            panel->keypad_jog.start_ms = ms;
+                            panel->keypad_jog.planned = 0.0f;
+                        }
+
+                        jogTarget = keypadJogProfile(jogAxis, ms - panel->keypad_jog.start_ms + panel_input_period() + panel_settings.jog_keypad_margin, &jogRate);
+                        jogDistance = min(jogTarget - panel->keypad_jog.planned, panel_settings.jog_distance_keypad);
+
+                        // nothing useful to add this time round, planner already holds enough
+                        if (jogDistance < 0.001f) {
+                            jogSend = false;
+                            break;
+                        }
+
+                        strcat(command, ftoa(jogDistance, 3));
+                        strcat(command, "F");
+                        strcat(command, ftoa(jogRate, 0));
+                    }
                     break;
 
                 default:
@@ -872,30 +3053,31 @@ static void processKeypad(uint16_t keydata[])
 
             }
             // don't repeat jog commands if in single step mode
-            if ((keypad_jog_mode == jog_mode_smooth || !jogInProgress))
-                jogInProgress = grbl.enqueue_gcode((char *)command);
+            if (jogSend && (keypad_jog_mode == jog_mode_smooth || !panel->keypad_jog.in_progress)) {
+                if ((panel->keypad_jog.in_progress = grbl.enqueue_gcode((char *)command)))
+                    panel->keypad_jog.planned += jogDistance;
+            }
         }
         // cancel jog immediately key released if smooth jogging
-        if ((!jogRequested) && (keypad_jog_mode == jog_mode_smooth) && jogInProgress)
+        if ((!jogRequested) && (keypad_jog_mode == jog_mode_smooth) && panel->keypad_jog.in_progress)
         {
             grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
-            jogInProgress = false;
-            jogRampCount = panel_settings.jog_accel_ramp;
+            panel->keypad_jog.in_progress = false;
         }
 
-        // set jogInProgress back to 0 at end of move in single-step
-        if ((!jogRequested) && (grbl_state == STATE_IDLE) && jogInProgress)
-            jogInProgress = false;
+        // set in_progress back to 0 at end of move in single-step
+        if ((!jogRequested) && (grbl_state == STATE_IDLE) && panel->keypad_jog.in_progress)
+            panel->keypad_jog.in_progress = false;
 
     }
-    last_keydata_3 = keydata_3.value;
+    last_keydata[2] = keydata_3.value;
 
     //
     // keydata_4
     // - key repeats not required
     // - overrides & resets from any state
     //
-    if (keydata_4.value != last_keydata_4) {
+    if (keydata_4.value != last_keydata[3]) {
         if (keydata_4.feed_override_reset)
             grbl.enqueue_realtime_command(CMD_OVERRIDE_FEED_RESET);
         if (keydata_4.spindle_override_reset)
@@ -904,261 +3086,530 @@ static void processKeypad(uint16_t keydata[])
             grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_RESET);
 
     }
-    last_keydata_4 = keydata_4.value;
+    last_keydata[3] = keydata_4.value;
+
+}
+
+// Detents in a count, truncated as by a division by the counts per detent. Shifted for powers of two, otherwise
+// multiplied by the rounded up reciprocal, which is exact for 16 bit counts.
+static inline uint_fast16_t encoderDetents (panel_encoder_data_t *encoder, uint_fast16_t counts)
+{
+    return encoder->cpd_shift != PANEL_ENCODER_CPD_RECIP ? counts >> encoder->cpd_shift
+                                                         : (uint_fast16_t)(((uint64_t)counts * encoder->cpd_recip) >> 32);
+}
+
+// Detents turned since the last reading. Also returns the counts past the last detent, to carry them over.
+static int16_t encoderSteps (panel_encoder_data_t *encoder, int8_t *modulo)
+{
+    int16_t delta = encoder->raw_value - encoder->last_raw_value;
+    int16_t steps = delta < 0 ? -(int16_t)encoderDetents(encoder, -(int32_t)delta) : (int16_t)encoderDetents(encoder, delta);
+
+    *modulo = encoder->raw_value - encoderDetents(encoder, encoder->raw_value) * encoder->cpd;
+    if (*modulo && steps < 0) {
+        *modulo = (encoder->cpd - *modulo) * -1;
+    }
 
+    return steps;
 }
 
 static void processEncoderOverride(uint8_t encoder_index)
 {
+    panel_encoder_data_t *encoder = &panel->encoder_data[encoder_index];
     int16_t signed_value;
-    uint16_t cmd_override_minus = 0, cmd_override_plus = 0;
     int8_t modulo;
 
-    switch (encoder_data[encoder_index].mode) {
-        case (spindle_override):
-            cmd_override_minus = CMD_OVERRIDE_SPINDLE_FINE_MINUS;
-            cmd_override_plus  = CMD_OVERRIDE_SPINDLE_FINE_PLUS;
-            break;
+    signed_value = encoderSteps(encoder, &modulo);
 
-        case (feed_override):
-            cmd_override_minus = CMD_OVERRIDE_FEED_FINE_MINUS;
-            cmd_override_plus  = CMD_OVERRIDE_FEED_FINE_PLUS;
-            break;
+    // don't do any overrides if not initialised, just store the initial reading
+    if (!encoder->init_ok) {
+        encoder->last_raw_value = encoder->raw_value;
+        return;
+    }
 
-        case (rapid_override):
-            break;
+    if (signed_value) {
 
-        default:
-            return;
+        uint16_t count = abs(signed_value);
+        uint8_t cmd = signed_value < 0 ? encoder->cmd_minus : encoder->cmd_plus;
+
+        for (uint16_t i = 0 ; i < count; i++)
+            grbl.enqueue_realtime_command(cmd);
 
+        // update last value
+        // note stored value is adjusted for partial ticks
+        encoder->last_raw_value = encoder->raw_value - modulo;
     }
+}
 
-    signed_value = encoder_data[encoder_index].raw_value - encoder_data[encoder_index].last_raw_value;
-    signed_value = signed_value / encoder_data[encoder_index].cpd;
+// rapid overrides are handled a bit differently, as only thee possible values..
+static void processEncoderRapid(uint8_t encoder_index)
+{
+    panel_encoder_data_t *encoder = &panel->encoder_data[encoder_index];
+    int16_t signed_value;
+    int8_t modulo;
 
-    modulo = encoder_data[encoder_index].raw_value % encoder_data[encoder_index].cpd;
-    if (modulo && signed_value < 0) {
-        modulo = (encoder_data[encoder_index].cpd - modulo) * -1;
-    }
+    signed_value = encoderSteps(encoder, &modulo);
 
     // don't do any overrides if not initialised, just store the initial reading
-    if (!encoder_data[encoder_index].init_ok) {
-        encoder_data[encoder_index].last_raw_value = encoder_data[encoder_index].raw_value;
+    if (!encoder->init_ok) {
+        encoder->last_raw_value = encoder->raw_value;
         return;
     }
 
     if (signed_value) {
 
-        if (encoder_data[encoder_index].mode == rapid_override) {
-
-            // rapid overrides are handled a bit differently, as only thee possible values..
-            if (signed_value < 0) {
-                switch (sys.override.rapid_rate) {
-
-                    case RAPID_OVERRIDE_LOW:
-                        break;
-
-                    case RAPID_OVERRIDE_MEDIUM:
-                        grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_LOW);
-                        break;
-
-                    case DEFAULT_RAPID_OVERRIDE:
-                        grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_MEDIUM);
-                        break;
-
-                    default:
-                        break;
-                }
-            } else {
-                switch (sys.override.rapid_rate) {
+        if (signed_value < 0) {
+            switch (sys.override.rapid_rate) {
 
-                    case RAPID_OVERRIDE_LOW:
-                        grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_MEDIUM);
-                        break;
+                case RAPID_OVERRIDE_LOW:
+                    break;
 
-                    case RAPID_OVERRIDE_MEDIUM:
-                        grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_RESET);
-                        break;
+                case RAPID_OVERRIDE_MEDIUM:
+                    grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_LOW);
+                    break;
 
-                    case DEFAULT_RAPID_OVERRIDE:
-                        break;
+                case DEFAULT_RAPID_OVERRIDE:
+                    grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_MEDIUM);
+                    break;
 
-                    default:
-                        break;
-                }
+                default:
+                    break;
             }
-
         } else {
+            switch (sys.override.rapid_rate) {
+
+                case RAPID_OVERRIDE_LOW:
+                    grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_MEDIUM);
+                    break;
+
+                case RAPID_OVERRIDE_MEDIUM:
+                    grbl.enqueue_realtime_command(CMD_OVERRIDE_RAPID_RESET);
+                    break;
 
-            uint16_t count = abs(signed_value);
-            bool is_negative = false;
-            if (signed_value < 0)
-                is_negative = true;
+                case DEFAULT_RAPID_OVERRIDE:
+                    break;
 
-            for (uint16_t i = 0 ; i < count; i++) {
-                if (is_negative)
-                    grbl.enqueue_realtime_command(cmd_override_minus);
-                else
-                    grbl.enqueue_realtime_command(cmd_override_plus);
+                default:
+                    break;
             }
         }
 
         // update last value
         // note stored value is adjusted for partial ticks
-        encoder_data[encoder_index].last_raw_value = encoder_data[encoder_index].raw_value - modulo;
+        encoder->last_raw_value = encoder->raw_value - modulo;
     }
 }
 
-static void processEncoderJog(uint8_t encoder_index, uint8_t jog_axis)
+static void processEncoderJog(uint8_t encoder_index)
 {
-
+    panel_encoder_data_t *encoder = &panel->encoder_data[encoder_index];
+    panel_jog_scale_t *scale = &jog_scales[jog_mode <= jog_mode_x100 ? jog_mode : 0];
     int16_t signed_value;
     char command[30] = "";
     bool jogOkay = (grbl_state == STATE_IDLE || (grbl_state & STATE_JOG));
     int8_t modulo;
 
-    signed_value = encoder_data[encoder_index].raw_value - encoder_data[encoder_index].last_raw_value;
-    signed_value = signed_value / encoder_data[encoder_index].cpd;
-
-    modulo = encoder_data[encoder_index].raw_value % encoder_data[encoder_index].cpd;
-    if (modulo && signed_value < 0) {
-        modulo = (encoder_data[encoder_index].cpd - modulo) * -1;
-    }
+    signed_value = encoderSteps(encoder, &modulo);
 
     // don't jog if not initialised - just store the initial reading (so we can't pick up a big jump on startup)
     // don't jog if in smooth mode - is meant for keypad jogging only (large distances requested, and cancelled on key release)
-    if (!encoder_data[encoder_index].init_ok || (jog_mode == jog_mode_smooth)) {
-        encoder_data[encoder_index].last_raw_value = encoder_data[encoder_index].raw_value;
+    if (!encoder->init_ok || !*scale->feed) {
+        encoder->last_raw_value = encoder->raw_value;
+        return;
+    }
+
+    // discard moves while another panel is jogging
+    if (signed_value && jogOkay && !jogClaim()) {
+        encoder->last_raw_value = encoder->raw_value - modulo;
         return;
     }
 
     if (signed_value && jogOkay) {
         strcpy(command, "$J=G91");
-        strcat(command, axis[jog_axis]);
+        strcat(command, axis[encoder->axis == PANEL_ENCODER_MPG_AXIS ? mpg_axis : encoder->axis]);
+        strcat(command, ftoa(signed_value * scale->distance, 3));
+        strcat(command, scale->feed);
 
-        switch (jog_mode) {
+        if (!plan_check_full_buffer()) {
+            if (grbl.enqueue_gcode((char *)command)) {
+                // update last value, and only if jog command was accepted
+                // note stored value is adjusted for partial ticks
+                encoder->last_raw_value = encoder->raw_value - modulo;
+            }
+        }
+    }
+}
 
-            case (jog_mode_x1):
-                strcat(command, ftoa(signed_value * panel_settings.jog_distance_x1, 3));
-                strcat(command, "F");
-                strcat(command, ftoa(panel_settings.jog_speed_x1, 0));
-                break;
+static void processEncoder(int index)
+{
+    panel_encoder_data_t *encoder = &panel->encoder_data[index];
 
-            case (jog_mode_x10):
-                strcat(command, ftoa(signed_value * panel_settings.jog_distance_x10, 3));
-                strcat(command, "F");
-                strcat(command, ftoa(panel_settings.jog_speed_x10, 0));
-                break;
+    if (encoder->init_ok && encoder->raw_value != encoder->last_raw_value)
+        pollActivity();
 
-            case (jog_mode_x100):
-                strcat(command, ftoa(signed_value * panel_settings.jog_distance_x100, 3));
-                strcat(command, "F");
-                strcat(command, ftoa(panel_settings.jog_speed_x100, 0));
-                break;
+    if (encoder->handler)
+        encoder->handler(index);
 
-            default:
-                 break;
+    // after first pass through, have populated the initial encoder values..
+    encoder->init_ok = true;
+}
 
-        }
+static void onReportOptions (bool newopt)
+{
+    on_report_options(newopt);
 
-        if (!plan_check_full_buffer()) {
-            if (grbl.enqueue_gcode((char *)command)) {
-                // update last value, and only if jog command was accepted
-                // note stored value is adjusted for partial ticks
-                encoder_data[encoder_index].last_raw_value = encoder_data[encoder_index].raw_value - modulo;
+    if(!newopt) {
+        hal.stream.write("[PLUGIN:PANEL v0.04]" ASCII_EOL);
+
+        for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++) {
+            if (panels[idx].caps.valid) {
+                hal.stream.write(idx ? "[PANEL2:FW v" : "[PANEL:FW v");
+                hal.stream.write(uitoa(panels[idx].caps.fw_major));
+                hal.stream.write(".");
+                hal.stream.write(uitoa(panels[idx].caps.fw_minor));
+                hal.stream.write(".");
+                hal.stream.write(uitoa(panels[idx].caps.fw_patch));
+                hal.stream.write(",PROTOCOL ");
+                hal.stream.write(uitoa(panels[idx].caps.protocol));
+                hal.stream.write(",KEYS ");
+                hal.stream.write(uitoa(panels[idx].caps.keys));
+                hal.stream.write(",ENCODERS ");
+                hal.stream.write(uitoa(panels[idx].caps.encoders));
+                hal.stream.write(",AXES ");
+                hal.stream.write(uitoa(panels[idx].caps.axes));
+                hal.stream.write("]" ASCII_EOL);
             }
         }
     }
 }
 
-static void processEncoder(int index)
+static status_code_t panel_report_stats (sys_state_t state, char *args)
 {
-    switch (encoder_data[index].mode) {
-        case (jog_mpg):
-            processEncoderJog(index, mpg_axis);
-            break;
+    hal.stream.write("[PANELSTATS:JOGDEADMAN:");
+    hal.stream.write(uitoa(panel_stats.jog_deadman_count));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.jog_deadman_latency_max));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:JOGCONFLICTS:");
+    hal.stream.write(uitoa(panel_stats.jog_conflicts));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:KEYEVENTS:");
+    hal.stream.write(uitoa(panel_stats.key_events));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.key_events_lost));
+    hal.stream.write("]" ASCII_EOL);
+
+    for (uint_fast8_t instance = 0; instance < PANEL_INSTANCES; instance++) {
+        panel_clock_t *clock = &panels[instance].clock;
+        if (clock->valid) {
+            hal.stream.write(instance ? "[PANELSTATS:CLOCK2:" : "[PANELSTATS:CLOCK:");
+            if (clock->offset < 0)
+                hal.stream.write("-");
+            hal.stream.write(uitoa(clock->offset < 0 ? -clock->offset : clock->offset));
+            hal.stream.write(",");
+            hal.stream.write(ftoa(clock->drift * 1000000.0f, 1));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(clock->delay));
+            hal.stream.write("]" ASCII_EOL);
+        }
+    }
 
-        case (jog_x):
-            processEncoderJog(index, 0);
-            break;
+    hal.stream.write("[PANELSTATS:LATENCY:ENQUEUE");
+    for (uint_fast8_t idx = 0; idx < PANEL_LATENCY_BUCKETS; idx++) {
+        hal.stream.write(",");
+        hal.stream.write(uitoa(panel_stats.latency_enqueue[idx]));
+    }
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.latency_enqueue_max));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:LATENCY:MOTION");
+    for (uint_fast8_t idx = 0; idx < PANEL_LATENCY_BUCKETS; idx++) {
+        hal.stream.write(",");
+        hal.stream.write(uitoa(panel_stats.latency_motion[idx]));
+    }
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.latency_motion_max));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:RTKEYS:");
+    hal.stream.write(uitoa(panel_stats.realtime_samples));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.realtime_interval_max));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:POSLOCKED:");
+    hal.stream.write(uitoa(panel_stats.position_snapshot_locked));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:EVENTS:");
+    hal.stream.write(uitoa(panel_stats.event_writes));
+    hal.stream.write("]" ASCII_EOL);
+
+    panel_instance_t *current = panel;
+
+    for (uint_fast8_t instance = 0; instance < panelsActive(); instance++) {
+        panel = &panels[instance];
+        hal.stream.write(instance ? "[PANELSTATS:LINK2:" : "[PANELSTATS:LINK:");
+        hal.stream.write(panel->transport->name);
+        hal.stream.write(",");
+        hal.stream.write(panel->transport->link_ok() ? "1" : "0");
+        hal.stream.write("]" ASCII_EOL);
+    }
 
-        case (jog_y):
-            processEncoderJog(index, 1);
-            break;
+    panel = current;
+
+#if PANEL_MODBUS
+    for (uint_fast8_t instance = 0; instance < panelsActive(); instance++) {
+        if (panels[instance].transport != &modbus_transport)
+            continue;
+        for (uint_fast8_t idx = 0; idx < Panel_ResponseCount; idx++) {
+            if (*transaction_names[idx]) {
+                hal.stream.write(instance ? "[PANELSTATS:MODBUS2:" : "[PANELSTATS:MODBUS:");
+                hal.stream.write(transaction_names[idx]);
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].completed));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].rtt_last));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].rtt_max));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].timeouts));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].stale));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].refused));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(panels[instance].transactions[idx].malformed));
+                hal.stream.write("]" ASCII_EOL);
+            }
+        }
+    }
 
-        case (jog_z):
-            processEncoderJog(index, 2);
-            break;
+    hal.stream.write("[PANELSTATS:BUS:");
+    hal.stream.write(uitoa(panel_stats.bus_utilisation));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.bus_utilisation_max));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.bus_display_shrunk));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.bus_display_skipped));
+    hal.stream.write("]" ASCII_EOL);
+#endif
 
-        case (jog_a):
-            processEncoderJog(index, 3);
-            break;
+    hal.stream.write("[PANELSTATS:POLL:");
+    hal.stream.write(uitoa(poll_interval));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.poll_backoff));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.poll_backoff_max));
+#if PANEL_MODBUS
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.poll_back_to_back));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.poll_duty_limited));
+#endif
+    hal.stream.write("]" ASCII_EOL);
+
+#if PANEL_CANBUS
+    hal.stream.write("[PANELSTATS:CANINPUTS:");
+    hal.stream.write(uitoa(panel_stats.can_snapshots));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.can_partial));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.can_stale));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.can_missed));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.can_malformed));
+    hal.stream.write("]" ASCII_EOL);
+#endif
 
-        case (jog_b):
-            processEncoderJog(index, 4);
-            break;
+#if PANEL_UART
+    hal.stream.write("[PANELSTATS:UART:");
+    hal.stream.write(uitoa(panel_stats.uart_rx));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.uart_tx));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.uart_errors));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.uart_overruns));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.uart_lost));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.uart_duplicates));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.uart_skipped));
+    hal.stream.write("]" ASCII_EOL);
+#endif
 
-        case (jog_c):
-            processEncoderJog(index, 5);
-            break;
+    hal.stream.write("[PANELSTATS:BULK:");
+    hal.stream.write(uitoa(panel_stats.bulk_transfers));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.bulk_chunks));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(panel_stats.bulk_resumed));
+    hal.stream.write("]" ASCII_EOL);
+
+    hal.stream.write("[PANELSTATS:SPINDLE:");
+    hal.stream.write(uitoa(panel_stats.spindle_refreshes));
+    for (uint_fast8_t idx = 0; idx < N_SYS_SPINDLE; idx++) {
+        if (spindle_cache[idx].valid) {
+            hal.stream.write(",");
+            hal.stream.write(uitoa(spindle_cache[idx].speed));
+        }
+    }
+    hal.stream.write("]" ASCII_EOL);
 
-        case (jog_u):
-            processEncoderJog(index, 6);
-            break;
+    return Status_OK;
+}
 
-        case (jog_v):
-            processEncoderJog(index, 7);
-            break;
+static const sys_command_t panel_command_list[] = {
+    { "PANELSTATS", panel_report_stats, { .noargs = On }, { .str = "output control panel statistics" } }
+};
 
-        case (feed_override):
-        case (spindle_override):
-        case (rapid_override):
-            processEncoderOverride(index);
-            break;
+static sys_commands_t panel_commands = {
+    .n_commands = sizeof(panel_command_list) / sizeof(sys_command_t),
+    .commands = panel_command_list
+};
 
-        default:
-            break;
+// Refresh the spindle telemetry cache in the background, one spindle per call. Retrieving the spindle state
+// may generate multiple new modbus requests (for instance Huanyang v1 uses seperate requests for RPM and Amps),
+// which can saturate the Modbus RX buffer if the spindle is offline, so this is paced by the Modbus RX timeout
+// and refreshed less often when the spindle is stopped.
+static void refreshSpindleCache (uint32_t ms)
+{
+    static uint_fast8_t idx = 0;
+    static uint32_t last_ms = 0;
+    spindle_ptrs_t *spindle;
+    panel_spindle_cache_t *cache;
+
+    // Spread the requests out, never more than one spindle per RX timeout
+    if (ms - last_ms < modbus_rx_timeout)
+        return;
 
+    if (++idx >= N_SYS_SPINDLE)
+        idx = 0;
+
+    cache = &spindle_cache[idx];
+
+    if (!(spindle = spindle_get(idx))) {
+        cache->valid = false;
+        cache->speed = cache->load = 0;
+        return;
     }
-    // after first pass through, have populated the initial encoder values..
-    encoder_data[index].init_ok = true;
+
+    if (cache->valid && ms - cache->refreshed_ms < (uint32_t)modbus_rx_timeout *
+                                                   (cache->running ? PANEL_SPINDLE_REFRESH_RUNNING : PANEL_SPINDLE_REFRESH_STOPPED))
+        return;
+
+    spindle_state_t spindle_state = spindle->get_state(spindle);
+
+    cache->running = spindle_state.on;
+
+    if(!spindle->get_data) {
+        cache->speed = lroundf(spindle_state.on ? spindle->param->rpm_overridden : 0);
+    } else {
+        cache->speed = lroundf(spindle->get_data(SpindleData_RPM)->rpm);
+    }
+
+#if VFD_ENABLE
+    if (idx == 0) {
+        const vfd_ptrs_t *vfd_spindle = vfd_get_active();
+        if (vfd_spindle && vfd_spindle->get_load) {
+            cache->load = lroundf(vfd_spindle->get_load());
+        }
+#if PANEL_MODBUS
+        // VFD requests share the bus, typically a read for RPM and one for load
+        if (vfd_spindle)
+            busAccount(2 * busFrameTime(8, 7));
+#endif
+    }
+#endif
+
+    cache->valid = true;
+    cache->refreshed_ms = last_ms = ms;
+    panel_stats.spindle_refreshes++;
 }
 
-static void onReportOptions (bool newopt)
+// Cancel a keypad jog if the panel has stopped sending keypad data, as the key release would never be seen
+static void checkJogDeadman (uint32_t ms)
 {
-    on_report_options(newopt);
+    uint32_t silent_ms = ms - panel->keydata_rx_ms;
 
-    if(!newopt) {
-        hal.stream.write("[PLUGIN:PANEL v0.03]" ASCII_EOL);
+    if (panel->keypad_jog.in_progress && panel_settings.jog_deadman &&
+         silent_ms > panel_settings.jog_deadman * panel_input_period()) {
+
+        grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
+        panel->keypad_jog.in_progress = false;
+
+        panel_stats.jog_deadman_count++;
+        if (silent_ms > panel_stats.jog_deadman_latency_max)
+            panel_stats.jog_deadman_latency_max = silent_ms;
     }
 }
 
-void ReadPanelInputs(void)
+// Polled panels are serviced by whose turn it is, pushed transports by their first panel for all their panels
+static bool panelServiced (bool polled_turn)
 {
-#if PANEL_ENABLE == 1
-    ReadModbusInputRegisters(false);      // do not block for modbus response
-#endif
+    return panel->transport->polled ? polled_turn : panel == transportPanel(panel->transport, 0);
+}
 
-#if PANEL_ENABLE == 2
-    // CAN data is pushed to callback, no need to poll
-#endif
+void ReadPanelInputs(void)
+{
+    if (panel->transport->polled)
+        panel->transport->poll();
 }
 
+// Display of the polled panel whose turn it is
 void WritePanelOutputs(void)
 {
-#if PANEL_ENABLE == 1
-    WriteModbusHoldingRegisters(false);   // do not block for modbus response
-#endif
+    if (panel->transport->polled)
+        panel->transport->publish();
+}
+
+#if PANEL_CANBUS || PANEL_UART
+// Display of the pushed transports, on their own clock rather than the polled panels' turns
+static void WritePushedOutputs(void)
+{
+    panel_instance_t *current = panel;
 
-#if PANEL_ENABLE == 2
-    WriteCANbusOutputs();
+    for (uint_fast8_t idx = 0; idx < panelsActive(); idx++) {
+        panel = &panels[idx];
+        if (!panel->transport->polled && panelServiced(false))
+            panel->transport->publish();
+    }
+
+    panel = current;
+}
 #endif
+
+void WritePanelEvent(void)
+{
+    for (uint_fast8_t idx = 0; idx < panelsActive(); idx++) {
+        panel = &panels[idx];
+        if (panelServiced(true))
+            panel->transport->event();
+    }
+
+    panel_stats.event_writes++;
 }
 
 void panel_update (sys_state_t state)
 {
     static uint32_t last_ms;
+    static uint32_t last_event_ms;
+    static uint32_t last_poll_ms;
+#if PANEL_CANBUS || PANEL_UART
+    static uint32_t last_push_ms;
+#endif
     static bool write = false;
+    static uint_fast8_t turn = 0;
+#if PANEL_MODBUS
+    static uint32_t last_realtime_ms;
+    static uint_fast8_t realtime_turn = 0;
+#endif
 
     // save into global variables for other functions to access the latest state..
     grbl_state = state;
@@ -1170,6 +3621,43 @@ void panel_update (sys_state_t state)
     if(ms == last_ms) // Don't check more than once every ms
         return;
 
+    for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++) {
+        panel = &panels[idx];
+        checkJogDeadman(ms);
+    }
+
+    // release jog ownership once the owner has stopped jogging
+    if (jog_owner >= 0 && !(grbl_state & STATE_JOG) && !panels[jog_owner].keypad_jog.in_progress &&
+         ms - jog_owner_ms > PANEL_JOG_OWNER_HOLD)
+        jog_owner = -1;
+
+    refreshSpindleCache(ms);
+
+#if PANEL_UART
+    // inputs pushed by a UART panel, processed as they arrive
+    ReadUartInputs();
+#endif
+
+    // Out of cycle update on state, alarm or override changes, rate limited
+    if (display_event && panel_settings.event_interval && (ms - last_event_ms >= panel_settings.event_interval)) {
+        display_event = false;
+        last_event_ms = ms;
+        WritePanelEvent();
+    }
+
+#if PANEL_MODBUS
+    // Priority lane for the realtime keys, polled faster than the full input block
+    if (panel_settings.realtime_interval && (ms - last_realtime_ms >= panel_settings.realtime_interval)) {
+        last_realtime_ms = ms;
+        if (realtime_turn >= transportPanels(&modbus_transport))
+            realtime_turn = 0;
+        if ((panel = transportPanel(&modbus_transport, realtime_turn++)))
+            ReadModbusRealtimeKeys();
+        else
+            panel = &panels[0];
+    }
+#endif
+
     // Initiate requests to the panel every PANEL_UPDATE_INTERVAL ms, alternating inputs (buttons/encoders) and outputs (display)
     //
     // CAN bus - not using remote frames (request/response), so they will just be processed as received? (callback from canbus plugin)
@@ -1178,15 +3666,56 @@ void panel_update (sys_state_t state)
     // what about overwriting values etc.. can we just process each message individually?
     //
     //
-    if (!(ms % panel_settings.update_interval) )
+    // With more than one polled panel, the panels take turns, inputs then outputs for each.
+#if PANEL_CANBUS || PANEL_UART
+    // Pushed transports publish on their own clock, at the display rate of a single polled panel without the Modbus
+    // backoff, so they are neither held up by the polled panels' turns nor by the Modbus bus load
+    if (ms - last_push_ms >= 2 * poll_base_interval) {
+        last_push_ms = ms;
+        WritePushedOutputs();
+    }
+#endif
+
+#if PANEL_MODBUS
+    if (ms - last_poll_ms >= poll_interval || busNextDue(ms))
+#else
+    if (ms - last_poll_ms >= poll_interval)
+#endif
     {
+        last_poll_ms = ms;
+        pollUpdate(ms);
+
+        if (turn >= transportPanels(NULL))
+            turn = 0;
+
+        if (!(panel = transportPanel(NULL, turn)))
+            panel = &panels[0];     // no polled panel, pushed transports only
+
         if (!write)
             ReadPanelInputs();
         else
             WritePanelOutputs();
 
         write = !write;
+
+        if (!write)
+            turn++;
+    }
+#if PANEL_MODBUS
+    // Bulk channel in the spare time before the next regular or realtime key poll, one chunk at a time
+    else {
+        uint32_t poll_due_ms = last_poll_ms + poll_interval;
+
+        if (panel_settings.realtime_interval && (int32_t)(last_realtime_ms + panel_settings.realtime_interval - poll_due_ms) < 0)
+            poll_due_ms = last_realtime_ms + panel_settings.realtime_interval;
+
+        for (uint_fast8_t n = 0; (panel = transportPanel(&modbus_transport, n)); n++) {
+            if (WriteModbusBulk(ms, poll_due_ms))
+                break;
+        }
+        panel = &panels[0];
     }
+#endif
 
     last_ms = ms;
 }
@@ -1195,16 +3724,20 @@ int plugins_enabled(void)
 {
     int res = false;
 
-#if PANEL_ENABLE == 1
+#if PANEL_MODBUS
     res = modbus_enabled();
 #endif
 
-#if PANEL_ENABLE == 2
+#if PANEL_CANBUS
     // fixme: returns false if called this early...
     //res = canbus_enabled();
     res = true;
 #endif
 
+#if PANEL_UART
+    res = res || uart.open;
+#endif
+
     return res;
 }
 
@@ -1214,15 +3747,35 @@ static void cancel_jog (sys_state_t state)
 
 void panel_init()
 {
-#if PANEL_ENABLE == 2
+#if PANEL_CANBUS
     canbus_init();
     task_add_immediate(panel_canbus_config, NULL);
 #endif
 
+#if PANEL_UART
+    io_stream_t const *stream;
+
+    // baud rate set from the settings once loaded
+    if ((stream = stream_open_instance(PANEL_UART_STREAM, uart_baud_rates[PANEL_DEFAULT_UART_BAUD], NULL, "Control panel"))) {
+        memcpy(&uart.stream, stream, sizeof(io_stream_t));
+        uart.stream.set_enqueue_rt_handler(stream_buffer_all);
+        uart.open = true;
+    }
+#endif
+
     if(plugins_enabled()) {
         if ((nvs_address = nvs_alloc(sizeof(panel_settings_t)))) {
 
+            for (uint_fast8_t idx = 0; idx < PANEL_INSTANCES; idx++) {
+                panels[idx].index = idx;
+                panels[idx].position_delta.keyframe_due = true;
+                panels[idx].input_chunks.n_registers = PANEL_MODBUS_READREG_COUNT;
+            }
+
+            setTransports();
+
             settings_register(&setting_details);
+            system_register_commands(&panel_commands);
 
             on_report_options = grbl.on_report_options;
             grbl.on_report_options = onReportOptions;
@@ -1231,6 +3784,24 @@ void panel_init()
             grbl.on_execute_realtime = panel_update;
 
             grbl.on_jog_cancel = cancel_jog;
+
+            on_wco_changed = grbl.on_wco_changed;
+            grbl.on_wco_changed = onWcoChanged;
+
+            on_tool_changed = grbl.on_tool_changed;
+            grbl.on_tool_changed = onToolChanged;
+
+            on_reset = grbl.on_reset;
+            grbl.on_reset = onReset;
+
+            on_state_change = grbl.on_state_change;
+            grbl.on_state_change = onStateChange;
+
+            on_override_changed = grbl.on_override_changed;
+            grbl.on_override_changed = onOverrideChanged;
+
+            on_gcode_message = grbl.on_gcode_message;
+            grbl.on_gcode_message = onGcodeMessage;
         }
     }
 }
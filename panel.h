@@ -30,7 +30,7 @@
 #include "driver.h"
 #endif
 
-#if PANEL_ENABLE == 1 || PANEL_ENABLE == 2
+#if PANEL_ENABLE >= 1 && PANEL_ENABLE <= 7
 
 #include <stdio.h>
 
@@ -47,9 +47,25 @@
 #include "keypad_bitfields.h"
 #include "canbus_ids.h"
 
+// Transports compiled in, one PANEL_ENABLE bit each - 1 Modbus, 2 CAN, 4 UART. With more than one the
+// transport is selected per panel at runtime.
+#define PANEL_MODBUS ((PANEL_ENABLE & 1) != 0)
+#define PANEL_CANBUS ((PANEL_ENABLE & 2) != 0)
+#define PANEL_UART   ((PANEL_ENABLE & 4) != 0)
+#define PANEL_TRANSPORT_SELECT ((PANEL_ENABLE & (PANEL_ENABLE - 1)) != 0)
+#define PANEL_TRANSPORT_FIRST (PANEL_MODBUS ? PanelTransport_Modbus : PANEL_CANBUS ? PanelTransport_CANbus : PanelTransport_UART)
+
 #define N_KEYDATAS 6
-#define N_ENCODERS 4
+#ifndef N_ENCODERS
+#define N_ENCODERS 8            // Encoders 4-7 are in input registers 112-115, max 8
+#endif
 
+// Bus load of the default intervals, at 19200 baud with 8N1 characters (about 0.52 ms each) and a 3.5 character
+// gap before each frame: an input read of 16 registers takes about 27 ms and a display write of 13 registers
+// about 26 ms, alternating each update interval, and a realtime key read about 11 ms. At 50 ms updates and 75 ms
+// realtime reads, faster than the 100 ms input period, the panel uses about 70% of the bus. This is within
+// PANEL_MODBUS_BUS_SHARE and leaves the rest for a VFD. Faster intervals need a higher baud rate, else the
+// update interval is backed off.
 #define PANEL_DEFAULT_UPDATE_INTERVAL     50         // Default update interval (ms)
 #define PANEL_DEFAULT_MODBUS_ADDRESS      0x0A       // Default modbus address
 #define PANEL_DEFAULT_SPINDLE_SPEED       1000       // Default spindle speed for cw/ccw buttons
@@ -64,7 +80,85 @@
 #define PANEL_DEFAULT_JOG_SPEED_X100      1000
 #define PANEL_DEFAULT_JOG_SPEED_KEYPAD    2000
 
-#define PANEL_DEFAULT_JOG_KEYPAD_RAMP     20
+#define PANEL_DEFAULT_JOG_KEYPAD_MARGIN   50         // Keypad jog lookahead beyond the next expected input poll (ms)
+#define PANEL_DEFAULT_JOG_DEADMAN         4          // Cancel keypad jog if no input for this many input periods
+#define PANEL_DEFAULT_REALTIME_INTERVAL   75         // Modbus poll interval for the realtime keys (ms)
+#define PANEL_DEFAULT_POSITION_FORMAT     PositionFormat_Float
+#define PANEL_DEFAULT_EVENT_INTERVAL      20         // Minimum time between out of cycle state updates (ms)
+#define PANEL_DEFAULT_MEDIUM_INTERVAL     250        // Update period for feed rate & line number (ms)
+#define PANEL_DEFAULT_SLOW_INTERVAL       1000       // Update period for WCS, tool, alarm & firmware data (ms)
+#define PANEL_DEFAULT_ACTIVE_INTERVAL     50         // Update interval while encoders, jog keys or the machine are moving (ms)
+#define PANEL_DEFAULT_IDLE_INTERVAL       250        // Update interval once the panel and machine have been quiet (ms)
+#define PANEL_DEFAULT_IDLE_TIMEOUT        30         // Quiet time before dropping to the idle interval (s)
+#define PANEL_DEFAULT_BUS_DUTY            0          // Modbus back-to-back polling duty cycle cap (%), 0 - timed polling only
+
+// Settings not allocated by the core, in a block of their own clear of the core and plugin ids
+#ifndef PANEL_SETTINGS_BASE
+#define PANEL_SETTINGS_BASE 900
+#endif
+
+#define Setting_Panel_JogDeadman          ((setting_id_t)(PANEL_SETTINGS_BASE + 0))
+#define Setting_Panel_RealtimeInterval    ((setting_id_t)(PANEL_SETTINGS_BASE + 1))
+#define Setting_Panel_PositionFormat      ((setting_id_t)(PANEL_SETTINGS_BASE + 2))
+#define Setting_Panel_Velocity            ((setting_id_t)(PANEL_SETTINGS_BASE + 3))
+#define Setting_Panel_EventInterval       ((setting_id_t)(PANEL_SETTINGS_BASE + 4))
+#define Setting_Panel_MediumInterval      ((setting_id_t)(PANEL_SETTINGS_BASE + 5))
+#define Setting_Panel_SlowInterval        ((setting_id_t)(PANEL_SETTINGS_BASE + 6))
+#define Setting_Panel_Encoder4_Mode       ((setting_id_t)(PANEL_SETTINGS_BASE + 7))
+#define Setting_Panel_Encoder4_Cpd        ((setting_id_t)(PANEL_SETTINGS_BASE + 8))
+#define Setting_Panel_Encoder5_Mode       ((setting_id_t)(PANEL_SETTINGS_BASE + 9))
+#define Setting_Panel_Encoder5_Cpd        ((setting_id_t)(PANEL_SETTINGS_BASE + 10))
+#define Setting_Panel_Encoder6_Mode       ((setting_id_t)(PANEL_SETTINGS_BASE + 11))
+#define Setting_Panel_Encoder6_Cpd        ((setting_id_t)(PANEL_SETTINGS_BASE + 12))
+#define Setting_Panel_Encoder7_Mode       ((setting_id_t)(PANEL_SETTINGS_BASE + 13))
+#define Setting_Panel_Encoder7_Cpd        ((setting_id_t)(PANEL_SETTINGS_BASE + 14))
+#define Setting_Panel2_ModbusAddress      ((setting_id_t)(PANEL_SETTINGS_BASE + 15))
+#define Setting_Panel_JogPriority         ((setting_id_t)(PANEL_SETTINGS_BASE + 16))
+#define Setting_Panel2_JogPriority        ((setting_id_t)(PANEL_SETTINGS_BASE + 17))
+#define Setting_Panel2_Encoder0_Mode      ((setting_id_t)(PANEL_SETTINGS_BASE + 18))
+#define Setting_Panel2_Encoder0_Cpd       ((setting_id_t)(PANEL_SETTINGS_BASE + 19))
+#define Setting_Panel2_Encoder1_Mode      ((setting_id_t)(PANEL_SETTINGS_BASE + 20))
+#define Setting_Panel2_Encoder1_Cpd       ((setting_id_t)(PANEL_SETTINGS_BASE + 21))
+#define Setting_Panel2_Encoder2_Mode      ((setting_id_t)(PANEL_SETTINGS_BASE + 22))
+#define Setting_Panel2_Encoder2_Cpd       ((setting_id_t)(PANEL_SETTINGS_BASE + 23))
+#define Setting_Panel2_Encoder3_Mode      ((setting_id_t)(PANEL_SETTINGS_BASE + 24))
+#define Setting_Panel2_Encoder3_Cpd       ((setting_id_t)(PANEL_SETTINGS_BASE + 25))
+#define Setting_Panel_ActiveInterval      ((setting_id_t)(PANEL_SETTINGS_BASE + 26))
+#define Setting_Panel_IdleInterval        ((setting_id_t)(PANEL_SETTINGS_BASE + 27))
+#define Setting_Panel_IdleTimeout         ((setting_id_t)(PANEL_SETTINGS_BASE + 28))
+#define Setting_Panel_BusDuty             ((setting_id_t)(PANEL_SETTINGS_BASE + 29))
+#define Setting_Panel_Transport           ((setting_id_t)(PANEL_SETTINGS_BASE + 30))
+#define Setting_Panel2_Transport          ((setting_id_t)(PANEL_SETTINGS_BASE + 31))
+#define Setting_Panel_UartBaud            ((setting_id_t)(PANEL_SETTINGS_BASE + 32))
+
+#define PANEL_SETTINGS_VERSION 2                        // panel_settings_t layout, bumped when fields are added
+
+#ifndef PANEL_INSTANCES
+#define PANEL_INSTANCES 1       // Panels per controller, max 2 - e.g. a main console and a handheld pendant
+#endif
+
+#define PANEL2_ENCODERS 4                               // Encoders configurable on the second panel
+#define PANEL_CANBUS_INSTANCE_OFFSET 0x20               // CAN id offset of the second panel frames, realtime keys are offset by 1
+#define PANEL_RATE_REFRESH_INTERVAL 10000               // Medium & slow rate windows are resent this often even if unchanged (ms)
+#define PANEL_LINK_TIMEOUT 1000                         // CAN or UART link considered down without inputs for this time (ms)
+#define PANEL_JOG_OWNER_HOLD 250                        // Time a panel keeps jog ownership after its last jog input (ms)
+#define PANEL_POLL_ACTIVE_HOLD 500                      // Active update interval kept after the last input activity (ms)
+#define PANEL_POLL_MAX_BACKOFF 4                        // Update interval multiplier limit while the bus is saturated
+
+#ifndef PANEL_POSITION_SNAPSHOT_RETRIES
+#define PANEL_POSITION_SNAPSHOT_RETRIES 4            // Attempts at a lock free position copy before masking interrupts
+#endif
+
+#ifndef PANEL_POSITION_KEYFRAME_INTERVAL
+#define PANEL_POSITION_KEYFRAME_INTERVAL 20             // Display updates between absolute position keyframes, in delta format
+#endif
+
+#ifndef PANEL_POSITION_KEYFRAME_UNACKED
+#define PANEL_POSITION_KEYFRAME_UNACKED 5               // As above, for transports without a keyframe acknowledgement (CAN, UART)
+#endif
+
+#define PANEL_POSITION_FRAME_DELTA 0x80                 // Position frame flag, set if positions are deltas from the referenced keyframe
+#define PANEL_POSITION_FORMAT_VELOCITY 0x80             // Position format flag, set if sample time and axis velocities follow the positions
 
 #ifndef PANEL_MODBUS_START_REG
 #define PANEL_MODBUS_START_REG 100
@@ -74,16 +168,183 @@
 #define PANEL_MODBUS_READREG_COUNT 16
 #endif
 
+#ifndef PANEL_MODBUS_REALTIME_REG
+#define PANEL_MODBUS_REALTIME_REG 106                   // Keypad_1, holds the realtime command keys
+#endif
+
 #ifndef PANEL_MODBUS_WRITEREG_COUNT
-#define PANEL_MODBUS_WRITEREG_COUNT 13
+#define PANEL_MODBUS_WRITEREG_COUNT 13                  // Float position format only, set to 7 + 2 * N_AXIS for all axes
+#endif
+
+#define PANEL_MODBUS_MAX_WRITEREGS ((MODBUS_MAX_ADU_SIZE - 9) / 2)
+#define PANEL_MODBUS_MAX_READREGS ((MODBUS_MAX_ADU_SIZE - 5) / 2)
+
+// Register maps larger than the ADU size are transferred in chunks
+#define PANEL_MODBUS_DISPLAY_REGS (7 + 2 * N_AXIS + 1 + N_AXIS)   // state, positions, sample time & velocities
+
+#ifndef PANEL_MODBUS_MEDIUM_REG
+#define PANEL_MODBUS_MEDIUM_REG 140                     // Holding registers for the medium rate display data
+#endif
+
+#ifndef PANEL_MODBUS_SLOW_REG
+#define PANEL_MODBUS_SLOW_REG 150                       // Holding registers for the slow rate display data
+#endif
+
+#define PANEL_MODBUS_MEDIUM_COUNT 4
+#define PANEL_MODBUS_SLOW_COUNT 5
+
+#ifndef PANEL_MODBUS_RX_TIMEOUT
+#define PANEL_MODBUS_RX_TIMEOUT 50                      // Modbus RX timeout if the controller setting is not available (ms)
+#endif
+
+#ifndef PANEL_MODBUS_BAUD
+#define PANEL_MODBUS_BAUD 19200                         // Should match the Modbus baud rate of the controller
 #endif
 
+#define PANEL_MODBUS_CHAR_BITS 10                       // start, 8 data & stop bit
+#define PANEL_MODBUS_BUS_SHARE 80                       // Bus time available to the panel, % of the input period
+#define PANEL_MODBUS_MAX_OUTSTANDING 2                  // Panel transactions queued before display writes are held back
+#define PANEL_MODBUS_MAX_SKIPS 2                        // Display writes skipped in a row before a reduced one is forced
+
+// RTU inter-frame gap, 3.5 characters or 1750 us above 19200 baud. In ms, rounded up to whole ticks, plus one more
+// tick as the gap is counted from the current tick, which may already be almost over.
+#define PANEL_MODBUS_FRAME_GAP_US (PANEL_MODBUS_BAUD > 19200 ? 1750UL : 35UL * PANEL_MODBUS_CHAR_BITS * 100000UL / PANEL_MODBUS_BAUD)
+#define PANEL_MODBUS_FRAME_GAP_MS ((PANEL_MODBUS_FRAME_GAP_US + 999) / 1000 + 1)
+
+// Spindle telemetry refresh period per spindle, in multiples of the Modbus RX timeout
+#define PANEL_SPINDLE_REFRESH_RUNNING 2
+#define PANEL_SPINDLE_REFRESH_STOPPED 10
+
 typedef enum {
     Panel_Idle = 0,
     Panel_ReadInputRegisters,
-    Panel_WriteHoldingRegisters
+    Panel_WriteHoldingRegisters,
+    Panel_ReadRealtimeKeys,
+    Panel_WritePositionKeyframe,
+    Panel_WriteMediumRegisters,
+    Panel_WriteSlowRegisters,
+    Panel_WriteStateRegisters,
+    Panel_ReadCapabilities,
+    Panel_WriteKeyEventAck,
+    Panel_WriteBulk,
+    Panel_ResponseCount
 } panel_modbus_response_t;
 
+#define PANEL_MODBUS_TX_TIMEOUT (4 * modbus_rx_timeout)  // Transaction considered lost if no response or exception (ms)
+
+#ifndef PANEL_MODBUS_CAPS_REG
+#define PANEL_MODBUS_CAPS_REG 90                        // Input registers for the panel capability block
+#endif
+
+#define PANEL_MODBUS_CAPS_COUNT 5
+#define PANEL_CAPS_ATTEMPTS 3                           // Capability requests before assuming a legacy panel
+
+#define PANEL_PROTOCOL_CAN_CYCLES 1                     // Protocol version from which CAN panels sequence their input cycles
+#define PANEL_PROTOCOL_KEY_EVENTS 2                     // Protocol version from which the panel latches key edges in an event FIFO
+
+#ifndef PANEL_KEY_EVENTS
+#define PANEL_KEY_EVENTS 4                              // Key events read per input round, max 4 to fit a CAN frame
+#endif
+
+#if PANEL_KEY_EVENTS < 1 || PANEL_KEY_EVENTS > 4
+#error "PANEL_KEY_EVENTS must be 1 to 4, the events of a round have to fit a CAN frame!"
+#endif
+
+#ifndef PANEL_MODBUS_EVENT_ACK_REG
+#define PANEL_MODBUS_EVENT_ACK_REG 160                  // Holding register for the sequence number of the last key event processed
+#endif
+
+#define PANEL_MODBUS_INPUT_REGS (PANEL_MODBUS_READREG_COUNT + 1 + PANEL_KEY_EVENTS)   // inputs, then event count & events from 116
+#define PANEL_KEY_EVENT_PRESSED 0x80                    // Key event flag, set for a press and clear for a release
+
+#ifndef PANEL_BULK_SIZE
+#define PANEL_BULK_SIZE 256                             // Largest bulk channel payload (bytes)
+#endif
+
+#ifndef PANEL_MODBUS_BULK_REG
+#define PANEL_MODBUS_BULK_REG 200                       // Holding registers for bulk channel chunks
+#endif
+
+#ifndef PANEL_UART_STREAM
+#define PANEL_UART_STREAM 2                             // Serial stream instance used by a UART panel, 0 is usually the host & 1 Modbus
+#endif
+
+#if PANEL_UART && MODBUS_ENABLE && defined(MODBUS_RTU_STREAM) && PANEL_UART_STREAM == MODBUS_RTU_STREAM
+#error "PANEL_UART_STREAM is the Modbus serial stream, set it to a free serial stream!"
+#endif
+
+#define PANEL_DEFAULT_UART_BAUD 0                       // 115200
+#define PANEL_UART_MAX_REGS 40                          // Registers per UART packet
+#define PANEL_UART_PACKET_SIZE (4 + 2 * PANEL_UART_MAX_REGS + 2)    // type, sequence, start register, registers & CRC
+#define PANEL_UART_FRAME_SIZE (PANEL_UART_PACKET_SIZE + PANEL_UART_PACKET_SIZE / 254 + 2)   // COBS overhead & delimiter
+#define PANEL_UART_TX_BACKLOG 128                       // Display updates skipped while more than this is queued for sending (bytes)
+
+#define PANEL_MODBUS_BULK_HEADER 4                      // Bulk chunk registers ahead of the data - id & transfer, length, offset, chunk length
+#define PANEL_CANBUS_BULK_FRAMES 4                      // Bulk data frames queued per display update
+
+#define PANEL_CLOCK_FILTER 8                            // Clock samples kept, the one with the lowest delay sets the offset
+#define PANEL_CLOCK_DRIFT_INTERVAL 10000                // Minimum time between offset estimates used for the drift (ms)
+#define PANEL_LATENCY_BUCKETS 8                         // Latency histogram buckets, < 2 ms, < 4 ms .. < 128 ms, then >= 128 ms
+#define PANEL_LATENCY_MOTION_TIMEOUT 1000               // Key press not followed by motion within this time is not traced (ms)
+#define PANEL_LATENCY_REALTIME_KEYS 0x000F              // Keypad word 1 - stop, feed hold, cycle start & reset, traced by processRealtimeKeys()
+#define PANEL_LATENCY_MOTION_KEYS_1 0x0006              // Keypad word 1 - feed hold & cycle start, traced to motion
+#define PANEL_LATENCY_MOTION_KEYS_3 0x03FF              // Keypad word 3 - jog keys, traced to motion
+
+// Capabilities reported by the panel at startup. Legacy panels that don't answer are assumed to have
+// 4 encoders, 6 keypad words, N_AXIS display axes and support all position encodings.
+typedef struct {
+    bool     valid;             // capability block received
+    bool     probed;            // capability block received, or legacy panel assumed
+    uint8_t  attempts;
+    uint8_t  address;           // Modbus address probed
+    uint8_t  protocol;          // register map / frame layout version
+    uint8_t  fw_major;
+    uint8_t  fw_minor;
+    uint8_t  fw_patch;
+    uint8_t  keys;              // keypad words
+    uint8_t  encoders;
+    uint8_t  axes;              // display axes
+    uint8_t  encodings;         // bit n set if panel_position_format_t n is supported, bit 7 velocities
+} panel_caps_t;
+
+// Progress through a register map transferred in chunks
+typedef struct {
+    uint8_t start;              // offset of the first register read from the start register
+    uint8_t n_registers;        // registers in the current round
+    uint8_t next;               // offset of the next chunk from the start register
+    uint8_t chunk;              // registers in the last chunk sent
+    bool    keyframe;           // round carries a delta format keyframe
+    uint8_t keyframe_id;        // id of that keyframe, promoted to the reference when the round completes
+} panel_modbus_chunks_t;
+
+// Outstanding request tracking, one entry per request type. The sequence number is sent in the
+// upper bits of the message context so that late replies to timed out requests can be dropped.
+typedef struct {
+    bool     pending;
+    uint8_t  seq;
+    uint32_t sent_ms;
+    uint16_t rtt_last;          // round trip time of the last completed request (ms)
+    uint16_t rtt_max;
+    uint32_t completed;
+    uint32_t timeouts;          // lost without a response or exception
+    uint32_t stale;             // late replies dropped
+    uint32_t refused;           // not sent as a request of the same type was still outstanding
+    uint32_t malformed;         // replies dropped, byte count not matching the registers asked for
+} panel_modbus_tx_t;
+
+typedef enum {
+    PanelRate_Fast   = 1 << 0,      // state, positions & velocities - every display update
+    PanelRate_Medium = 1 << 1,      // feed rate & line number
+    PanelRate_Slow   = 1 << 2       // WCS, tool, alarm & firmware info
+} panel_rate_class_t;
+
+typedef enum {
+    PositionFormat_Float = 0,       // IEEE float, mm
+    PositionFormat_Micron,          // int32, 1 um
+    PositionFormat_SubMicron,       // int32, 0.1 um
+    PositionFormat_Delta            // int16 1 um increments from the last acknowledged int32 1 um keyframe
+} panel_position_format_t;
+
 typedef enum {
     jog_mode_x1 = 1,
     jog_mode_x10 = 2,
@@ -107,14 +368,104 @@ typedef enum {
     jog_v            = 12
 } panel_encoder_mode_t;
 
+#define PANEL_ENCODER_MPG_AXIS 0xFF                     // Encoder jogs the axis selected at run time
+#define PANEL_ENCODER_CPD_RECIP 0xFF                    // Counts per detent not a power of two, use the reciprocal
+
+typedef void (*panel_encoder_handler_ptr)(uint8_t encoder_index);
+
+// Per encoder state. The handler, axis, override commands and counts per detent scaling are precomputed
+// from the settings, see setEncoderHandlers().
 typedef struct {
     uint8_t              init_ok;
     uint8_t              cpd;
     uint16_t             raw_value;
     uint16_t             last_raw_value;
     panel_encoder_mode_t mode;
+    panel_encoder_handler_ptr handler;  // NULL if unused
+    uint8_t              axis;          // jog axis, or PANEL_ENCODER_MPG_AXIS
+    uint8_t              cmd_minus;     // override commands
+    uint8_t              cmd_plus;
+    uint8_t              cpd_shift;     // log2 of the counts per detent, or PANEL_ENCODER_CPD_RECIP
+    uint32_t             cpd_recip;     // 2^32 / counts per detent, rounded up
 } panel_encoder_data_t;
 
+// Encoder jog distance & pre-formatted feed per jog mode, precomputed from the settings
+typedef struct {
+    float distance;
+    char  feed[12];             // "F" and the jog speed, empty if the jog mode does not use encoders
+} panel_jog_scale_t;
+
+typedef struct {
+    bool     in_progress;
+    uint32_t start_ms;          // time the current keypad jog started
+    float    planned;           // distance requested so far in the current keypad jog
+} panel_keypad_jog_t;
+
+typedef struct {
+    uint32_t jog_deadman_count;         // keypad jogs cancelled due to missing panel input
+    uint32_t jog_deadman_latency_max;   // longest time since last input when cancelled (ms)
+    uint32_t realtime_samples;          // realtime key samples received, from any source
+    uint32_t realtime_interval_max;     // longest time between realtime key samples (ms)
+    uint32_t position_snapshot_locked;  // position snapshots that had to fall back to masking interrupts
+    uint32_t event_writes;              // out of cycle state updates sent on state/alarm/override changes
+    uint32_t spindle_refreshes;         // spindle telemetry cache refreshes, all spindles
+    uint32_t jog_conflicts;             // jog inputs ignored as another panel was jogging
+    uint32_t can_snapshots;             // complete CAN input snapshots processed
+    uint32_t can_partial;               // snapshots dropped as frames were missing
+    uint32_t can_stale;                 // snapshots dropped as repeated or out of order
+    uint32_t can_missed;                // panel cycles never committed, from sequence gaps
+    uint32_t can_malformed;             // input frames dropped, shorter than their layout
+    uint32_t key_events;                // latched key edges processed
+    uint32_t key_events_lost;           // key edges missing from the event sequence
+    uint32_t latency_enqueue[PANEL_LATENCY_BUCKETS];    // panel input sample to key press processed, histogram
+    uint32_t latency_enqueue_max;       // (ms)
+    uint32_t latency_motion[PANEL_LATENCY_BUCKETS];     // panel input sample to motion starting, histogram
+    uint32_t latency_motion_max;        // (ms)
+    uint8_t  bus_utilisation;           // shared Modbus bus time used in the last input period (%)
+    uint8_t  bus_utilisation_max;
+    uint32_t bus_display_shrunk;        // display writes reduced to fit the bus budget
+    uint32_t bus_display_skipped;       // display writes skipped, bus budget exhausted
+    uint8_t  poll_backoff;              // update interval multiplier, raised while the bus is saturated
+    uint8_t  poll_backoff_max;
+    uint32_t poll_back_to_back;         // transactions sent straight after the previous reply
+    uint32_t poll_duty_limited;         // back-to-back transactions held back by the duty cycle cap
+    uint32_t bulk_transfers;            // bulk channel payloads queued
+    uint32_t bulk_chunks;               // bulk chunks sent, Modbus writes or CAN frames
+    uint32_t bulk_resumed;              // bulk chunks sent again after a failed transfer
+    uint32_t uart_rx;                   // UART packets received
+    uint32_t uart_tx;                   // UART packets sent
+    uint32_t uart_errors;               // UART frames dropped, bad CRC, COBS encoding or length
+    uint32_t uart_overruns;             // UART frames dropped, longer than the receive buffer
+    uint32_t uart_lost;                 // UART packets missing from the panel sequence
+    uint32_t uart_duplicates;           // UART packets dropped, repeating the last sequence number
+    uint32_t uart_skipped;              // UART display updates skipped, transmit backlog
+} panel_stats_t;
+
+typedef enum {
+    PanelBus_Priority = 0,      // realtime keys, inputs & events - always sent
+    PanelBus_Display            // regular display writes - only if the budget allows
+} panel_bus_priority_t;
+
+typedef struct {
+    uint32_t cycle_start_ms;
+    uint32_t budget_us;         // bus time available to the panel this input period
+    uint32_t used_us;           // bus time used this input period, panel & VFD
+    uint32_t last_tx_ms;
+    uint8_t  outstanding;       // panel transactions awaiting a response
+    uint8_t  skipped;           // display writes skipped in a row
+    bool     next_due;          // back-to-back polling, next transaction after the inter-frame gap
+    bool     next_held;         // next transaction held back by the duty cycle cap
+    uint32_t next_ms;
+} panel_bus_t;
+
+typedef struct {
+    bool     valid;
+    bool     running;
+    uint32_t refreshed_ms;
+    uint16_t speed;             // RPM
+    uint16_t load;              // only available for the active VFD spindle
+} panel_spindle_cache_t;
+
 typedef union {
     float   value;
     uint8_t bytes[4];
@@ -130,9 +481,41 @@ typedef struct {
     uint8_t        wcs;
     uint8_t        mpg_mode;
     uint8_t        jog_mode;
+    uint8_t        position_format;
+    uint8_t        position_frame;                  // keyframe id, plus PANEL_POSITION_FRAME_DELTA flag for delta frames
     float32_data_t position[N_AXIS];
+    int32_t        position_fixed[N_AXIS];          // fixed point positions, or deltas, for compact formats
+    uint16_t       sample_ms;                       // controller time the position was sampled, low 16 bits (ms)
+    int16_t        velocity[N_AXIS];                // axis velocities at sample time (0.1 mm/s)
+    float32_data_t feed_rate;                       // current feed rate (mm/min)
+    int32_t        line_number;                     // line number of the executing block, 0 if none
+    uint32_t       tool;
+    uint8_t        alarm;
+    uint32_t       firmware_build;
 } panel_displaydata_t;
 
+typedef struct {
+    int32_t reference[N_AXIS];      // last acknowledged keyframe, deltas are sent relative to this
+    int32_t pending[N_AXIS];        // last keyframe sent, becomes the reference when acknowledged
+    uint8_t reference_id;
+    uint8_t pending_id;
+    uint8_t frames;                 // frames sent since the last keyframe
+    bool    reference_ok;
+    bool    keyframe_due;           // keyframe sent but not acknowledged, so send another
+} panel_position_delta_t;
+
+// Medium & slow rate data last sent to a panel, windows due with unchanged data are skipped
+typedef struct {
+    float    feed_rate;
+    int32_t  line_number;
+    uint32_t tool;
+    uint8_t  alarm;
+    uint8_t  wcs;
+    bool     medium_valid;
+    bool     slow_valid;
+    uint32_t refresh_ms;        // unchanged windows are sent anyway every PANEL_RATE_REFRESH_INTERVAL
+} panel_rate_sent_t;
+
 typedef struct {
     uint8_t  modbus_address;
     uint16_t update_interval;
@@ -148,12 +531,215 @@ typedef struct {
     float    jog_distance_x100;
     float    jog_distance_keypad;
 
-    uint8_t  jog_accel_ramp;
+    uint8_t  jog_keypad_margin;
 
     uint8_t  encoder_mode[N_ENCODERS];
     uint8_t  encoder_cpd[N_ENCODERS];
+
+    // added after the core settings, new fields go at the end and bump PANEL_SETTINGS_VERSION
+    uint8_t  jog_deadman;
+    uint8_t  realtime_interval;
+    uint8_t  position_format;
+    bool     velocity;
+    uint8_t  event_interval;
+    uint16_t medium_interval;
+    uint16_t slow_interval;
+#if PANEL_INSTANCES > 1
+    uint8_t  panel2_modbus_address;     // 0 - second panel disabled (Modbus only)
+    uint8_t  panel2_encoder_mode[PANEL2_ENCODERS];
+    uint8_t  panel2_encoder_cpd[PANEL2_ENCODERS];
+    uint8_t  jog_priority[PANEL_INSTANCES];
+#endif
+    uint16_t active_interval;           // 0 - don't speed up when active
+    uint16_t idle_interval;
+    uint8_t  idle_timeout;              // 0 - don't slow down when idle
+    uint8_t  bus_duty;                  // 0 - timed polling only (Modbus)
+#if PANEL_TRANSPORT_SELECT
+    uint8_t  transport[PANEL_INSTANCES];    // panel_transport_id_t
+#endif
+#if PANEL_UART
+    uint8_t  uart_baud;                 // index into the UART baud rates
+#endif
+    uint8_t  version;                   // PANEL_SETTINGS_VERSION, older layouts are restored to defaults
 } panel_settings_t;
 
-#endif /* PANEL_ENABLE == 1 || PANEL_ENABLE == 2 */
+// CAN input frames making up one panel cycle. KEYPAD_2 is sent last and commits the cycle, with the cycle
+// sequence number in byte 4 and the mask of frames sent in the cycle in byte 5.
+typedef enum {
+    PanelFrame_Keypad1  = 1 << 0,
+    PanelFrame_Keypad2  = 1 << 1,
+    PanelFrame_Encoder1 = 1 << 2,
+    PanelFrame_Encoder2 = 1 << 3
+} panel_can_frame_t;
+
+typedef struct {
+    uint16_t keydata[N_KEYDATAS];
+    uint16_t encoder[N_ENCODERS];
+    uint8_t  received;          // panel_can_frame_t mask of frames received since the last commit
+    uint8_t  seq;               // sequence number of the last complete snapshot
+    bool     seq_valid;
+} panel_can_snapshot_t;
+
+// Key edges latched by the panel, each event is a sequence number and a key - word * 16 + bit, plus the pressed flag
+typedef struct {
+    uint8_t  seq;               // last event processed
+    bool     seq_valid;
+    bool     ack_due;           // last event processed not yet acknowledged to the panel
+} panel_key_events_t;
+
+typedef struct {
+    uint32_t panel_ms;          // panel tick count
+    uint32_t ctrl_ms;           // controller time, the midpoint of the request round trip on Modbus
+    uint16_t delay;             // request round trip time on Modbus, 0 on CAN & UART (ms)
+} panel_clock_sample_t;
+
+// Panel clock relative to the controller, panel ticks = controller ms + offset + drift * (controller ms - ref_ms)
+typedef struct {
+    panel_clock_sample_t samples[PANEL_CLOCK_FILTER];
+    uint8_t  next;
+    uint8_t  count;
+    bool     valid;
+    int32_t  offset;            // ms
+    uint32_t ref_ms;            // controller time of the sample the offset is from
+    uint16_t delay;             // delay of that sample (ms)
+    float    drift;             // panel clock rate error, ms per ms
+    int32_t  drift_offset;      // earlier offset estimate the drift is measured from
+    uint32_t drift_ms;
+    bool     sample_valid;
+    uint32_t sample_ms;         // controller time of the last input sample
+    bool     motion_trace;      // key press waiting for motion to start
+    uint32_t press_ms;          // controller time of the input sample with the key press
+} panel_clock_t;
+
+typedef enum {
+    PanelBulk_Message = 1,      // (MSG, ...) text from the running program
+    PanelBulk_User              // first id for payloads from other plugins
+} panel_bulk_id_t;
+
+// Bulk channel payload, a new payload replaces the transfer in progress
+typedef struct {
+    uint8_t  id;
+    uint8_t  transfer;          // incremented for each payload, so the panel can drop a partial one
+    uint16_t length;
+    uint8_t  data[PANEL_BULK_SIZE];
+} panel_bulk_t;
+
+// Per panel bulk transfer progress, resumed from the last acknowledged offset
+typedef struct {
+    uint8_t  transfer;
+    uint16_t offset;            // bytes acknowledged
+    uint16_t chunk;             // bytes in the chunk in flight
+} panel_bulk_progress_t;
+
+// Bit numbers of the transports in PANEL_ENABLE
+typedef enum {
+    PanelTransport_Modbus = 0,
+    PanelTransport_CANbus,
+    PanelTransport_UART
+} panel_transport_id_t;
+
+// Transport operations, all act on the panel being serviced. Polled transports read the panel inputs on
+// request and take turns with their panels, the others have their inputs pushed by the panels and send
+// display data once for all their panels. Both deliver decoded inputs to processKeypad() & processEncoder().
+typedef struct {
+    const char *name;
+    bool     polled;
+    void     (*poll)(void);             // request the panel inputs
+    void     (*publish)(void);          // send the display data
+    void     (*event)(void);            // send the state & overrides out of cycle
+    void     (*capabilities)(void);     // ask the panel for its capabilities
+    bool     (*link_ok)(void);          // panel is answering
+    uint32_t (*input_period)(void);     // expected time between input samples (ms)
+} panel_transport_t;
+
+typedef enum {
+    PanelField_Word = 0,        // whole register, or both registers for 32 bit fields
+    PanelField_High,            // high byte of the register
+    PanelField_Low
+} panel_field_byte_t;
+
+// Display data fields and where each transport carries them, the one description the Modbus & UART register
+// windows and the CAN state frames are packed from. 32 bit fields take two registers, low word first, and are
+// sent high byte first on CAN, as are 16 bit fields. Register 0 or CAN frame 0 if not carried by that transport.
+// The values are expressions of the display data and the position format sent, format.
+// Covers the state, medium and slow rate fields only. The per axis runs of positions and velocities follow
+// the state fields and are packed by packPositionWords(), panel inputs are decoded by each transport.
+//
+//   X(value,                                bits, register, byte,         CAN frame,              CAN byte)
+#define PANEL_DISPLAY_FIELDS(X) \
+    X(displaydata->grbl_state,               16,   100, PanelField_Word,  CANBUS_PANEL_STATE_1,   2) \
+    X(format,                                 8,   101, PanelField_High,  CANBUS_PANEL_STATE_1,   0) \
+    X(displaydata->position_frame,            8,   101, PanelField_Low,   CANBUS_PANEL_STATE_1,   1) \
+    X(displaydata->spindle_speed,            16,   102, PanelField_Word,  CANBUS_PANEL_STATE_1,   4) \
+    X(displaydata->spindle_load,             16,   103, PanelField_Word,  CANBUS_PANEL_STATE_1,   6) \
+    X(displaydata->wcs,                       8,   104, PanelField_High,  CANBUS_PANEL_STATE_2,   3) \
+    X(displaydata->spindle_override,          8,   104, PanelField_Low,   CANBUS_PANEL_STATE_2,   0) \
+    X(displaydata->rapid_override,            8,   105, PanelField_High,  CANBUS_PANEL_STATE_2,   2) \
+    X(displaydata->feed_override,             8,   105, PanelField_Low,   CANBUS_PANEL_STATE_2,   1) \
+    X(displaydata->mpg_mode,                  8,   106, PanelField_High,  CANBUS_PANEL_STATE_2,   4) \
+    X(displaydata->jog_mode,                  8,   106, PanelField_Low,   CANBUS_PANEL_STATE_2,   5) \
+    X(displaydata->sample_ms,                16,     0, PanelField_Word,  CANBUS_PANEL_STATE_2,   6) \
+    X(floatBits(&displaydata->feed_rate),    32,   140, PanelField_Word,  CANBUS_PANEL_STATE_3,   0) \
+    X(displaydata->line_number,              32,   142, PanelField_Word,  CANBUS_PANEL_STATE_3,   4) \
+    X(displaydata->tool,                     32,   150, PanelField_Word,  CANBUS_PANEL_STATE_4,   0) \
+    X(displaydata->alarm,                     8,   152, PanelField_Low,   CANBUS_PANEL_STATE_4,   4) \
+    X(displaydata->wcs,                       8,     0, PanelField_Word,  CANBUS_PANEL_STATE_4,   5) \
+    X(displaydata->firmware_build,           32,   153, PanelField_Word,  CANBUS_PANEL_STATE_5,   0)
+
+// Per panel state, each panel has its own inputs, jog state and transfer progress
+typedef struct {
+    uint8_t                index;
+    const panel_transport_t *transport;
+    uint16_t               keydata[N_KEYDATAS];
+    uint16_t               last_keydata[N_KEYDATAS];   // for change detection in processKeypad()
+    uint16_t               realtime_keys;              // last realtime keys, for rising edge detection
+    panel_encoder_data_t   encoder_data[N_ENCODERS];
+    panel_keypad_jog_t     keypad_jog;
+    uint32_t               keydata_rx_ms;              // time fresh keypad data was last received
+    panel_caps_t           caps;
+    panel_position_delta_t position_delta;
+    float                  velocity_position[N_AXIS];  // machine position at the last velocity sample
+    uint32_t               medium_ms;                  // display data classes last sent
+    uint32_t               slow_ms;
+    bool                   classes_started;
+    bool                   slow_due;                   // slow rate data has changed, send with the next update
+    panel_rate_sent_t      rate_sent;
+    uint16_t               input_registers[PANEL_MODBUS_INPUT_REGS];
+    panel_modbus_chunks_t  input_chunks;
+    uint16_t               display_registers[PANEL_MODBUS_DISPLAY_REGS];
+    panel_modbus_chunks_t  display_chunks;
+    panel_modbus_tx_t      transactions[Panel_ResponseCount];
+    panel_can_snapshot_t   can_snapshot;
+    panel_key_events_t     key_events;
+    panel_clock_t          clock;
+    panel_bulk_progress_t  bulk;
+} panel_instance_t;
+
+// UART packets carry the Modbus register map without the request/response turnaround. Each is COBS encoded
+// and terminated by a zero byte: type, sequence number, start register (high byte first), 16 bit registers
+// (high byte first) and the Modbus CRC16 of the preceding bytes (low byte first).
+typedef enum {
+    PanelUart_ReadRegisters  = 0x04,    // controller to panel - send input registers, register count as the only data
+    PanelUart_WriteRegisters = 0x10,    // controller to panel - holding registers
+    PanelUart_InputRegisters = 0x84     // panel to controller - input registers, pushed or as asked for
+} panel_uart_packet_t;
+
+#if PANEL_UART
+typedef struct {
+    io_stream_t   stream;
+    bool          open;
+    uint8_t       rx_buffer[PANEL_UART_FRAME_SIZE];
+    uint_fast16_t rx_length;
+    bool          rx_overrun;           // discard up to the next delimiter
+    uint8_t       rx_seq;
+    bool          rx_seq_valid;
+    uint8_t       tx_seq;
+    uint8_t       format;               // position format of the last display packet, for state updates
+} panel_uart_t;
+#endif
+
+bool panel_bulk_send (uint8_t id, const uint8_t *data, uint16_t length);
+
+#endif /* PANEL_ENABLE >= 1 && PANEL_ENABLE <= 7 */
 
 #endif /* _PANEL_H_ */